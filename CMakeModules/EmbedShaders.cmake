@@ -0,0 +1,43 @@
+# Generates a C++ source with the contents of the GLSL files in a
+# directory as char arrays. Run in script mode:
+#	cmake -DOUTPUT=<file.cpp> -DSHADER_DIR=<dir> -P EmbedShaders.cmake
+#
+# The shaders are stored unprocessed, ShaderUtility resolves @include
+# and @if directives at runtime as it does for files on disk.
+# See src/osgGeo/EmbeddedShaders.h for the generated table.
+
+IF(NOT OUTPUT OR NOT SHADER_DIR)
+    MESSAGE(FATAL_ERROR "EmbedShaders.cmake needs OUTPUT and SHADER_DIR")
+ENDIF()
+
+FILE(GLOB SHADERS ${SHADER_DIR}/*.glsl)
+
+SET(_content "// Generated by EmbedShaders.cmake, do not edit.\n\n")
+SET(_content "${_content}#include \"EmbeddedShaders.h\"\n\nnamespace osgGeo\n{\n\nnamespace\n{\n")
+SET(_table "")
+
+SET(_idx 0)
+FOREACH(_shader ${SHADERS})
+    GET_FILENAME_COMPONENT(_name ${_shader} NAME)
+
+    # Hex avoids escaping issues and compiler limits on string literals
+    FILE(READ ${_shader} _hex HEX)
+    STRING(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," _bytes "${_hex}")
+    STRING(REGEX REPLACE "(0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,0x..,)" "\\1\n    " _bytes "${_bytes}")
+
+    SET(_content "${_content}\n// ${_name}\nconst unsigned char shader${_idx}[] = {\n    ${_bytes}0x00\n};\n")
+    SET(_table "${_table}    { \"${_name}\", reinterpret_cast<const char*>(shader${_idx}) },\n")
+    MATH(EXPR _idx "${_idx} + 1")
+ENDFOREACH()
+
+SET(_content "${_content}\n}\n\nextern const EmbeddedShader embeddedShaders[] =\n{\n${_table}    { 0, 0 }\n};\n\n}\n")
+
+# Only touch the output if something changed to avoid needless rebuilds
+IF(EXISTS ${OUTPUT})
+    FILE(READ ${OUTPUT} _old)
+    IF(_old STREQUAL _content)
+        RETURN()
+    ENDIF()
+ENDIF()
+
+FILE(WRITE ${OUTPUT} "${_content}")
@@ -5,12 +5,9 @@
 #include <osgViewer/ViewerEventHandlers>
 #include <osgGeo/Horizon3D>
 #include <osgGeo/Horizon3D2>
-#include <osgGeo/ShaderUtility.h>
 
 int main(int argc, char **argv)
 {
-    osgGeo::ShaderUtility::setRootPath("/ldata1/hg/osg/osgGeo/src/osgGeo/shaders");
-
     double undef = 999999.0;
 
     int sizes[7] = {255, 511, 1021, 2041, 3061, 4081, 8161};
@@ -0,0 +1,38 @@
+//      =================================================================
+//      |                                                               |
+//      |                       COPYRIGHT (C) 2012                      |
+//      |               ARK CLS Ltd, Bedford, Bedfordshire, UK          |
+//      |                                                               |
+//      |                       All Rights Reserved                     |
+//      |                                                               |
+//      | This software is confidential information which is proprietary|
+//      | to and a trade secret of ARK-CLS Ltd. Use, duplication, or    |
+//      | disclosure is subject to the terms of a separate source code  |
+//      | licence agreement.                                            |
+//      |                                                               |
+//      =================================================================
+//
+//
+
+#ifndef EMBEDDEDSHADERS_H
+#define EMBEDDEDSHADERS_H
+
+namespace osgGeo
+{
+
+/**
+  * Shader sources compiled into the library, generated at build time
+  * from the files in shaders/ by CMakeModules/EmbedShaders.cmake.
+  */
+struct EmbeddedShader
+{
+    const char *name;
+    const char *source;
+};
+
+//! Terminated by an entry with null name
+extern const EmbeddedShader embeddedShaders[];
+
+}
+
+#endif // EMBEDDEDSHADERS_H
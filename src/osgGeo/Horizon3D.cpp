@@ -23,6 +23,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include <osgGeo/LayeredTexture>
 #include <osgGeo/Palette>
 
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
 #include <iostream>
 
 namespace osgGeo
@@ -46,6 +49,9 @@ public:
         osg::Vec2d iInc, jInc; // increments of realworld coordinates along the grid dimensions
         int numHTiles, numVTiles; // number of tiles of horizon within
         osg::ref_ptr<osgGeo::LayeredTexture> laytex;
+        osg::ref_ptr<osg::StateSet> extrasStateSet;
+        // guards the parent list of extrasStateSet
+        mutable OpenThreads::Mutex extrasMutex;
     };
 
     struct Result
@@ -482,17 +488,8 @@ void Horizon3DTesselator::run()
 
                 tileNode->setPointLineNode(resLevel, geode);
 
-                // Temporary disable shaders for lines and points as they affect triangles
-                // as well, possibly a bug in OSG
-                osg::StateSet *ss = geode->getOrCreateStateSet();
-
-                osg::Program* program = new osg::Program;
-                program->setName( "microshader" );
-                program->addShader( new osg::Shader( osg::Shader::VERTEX, shaderVertSource ) );
-                program->addShader( new osg::Shader( osg::Shader::FRAGMENT, shaderFragSource ) );
-
-                ss->addUniform(new osg::Uniform("colour", colour));
-                ss->setAttributeAndModes( program, osg::StateAttribute::ON );
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock(data.extrasMutex);
+                geode->setStateSet(data.extrasStateSet.get());
             }
         }
         Result result;
@@ -520,49 +517,53 @@ Horizon3DNode::Horizon3DNode(const Horizon3DNode& other,
 void Horizon3DNode::init()
 {
     _texture = new osgGeo::LayeredTexture();
+
+    // Temporary disable shaders for lines and points as they affect triangles
+    // as well, possibly a bug in OSG
+    osg::Program* program = new osg::Program;
+    program->setName( "microshader" );
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, shaderVertSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, shaderFragSource ) );
+
+    _extrasStateSet = new osg::StateSet;
+    _extrasStateSet->addUniform(new osg::Uniform("colour", osg::Vec4(1.0f, 0.0f, 1.0f, 1.0f)));
+    _extrasStateSet->setAttributeAndModes( program, osg::StateAttribute::ON );
 }
 
 osg::Image *Horizon3DNode::makeElevationTexture()
 {
-    osg::Image *img = new osg::Image();
     osgGeo::Vec2i sz = getSize();
+    osg::DoubleArray *depthVals = dynamic_cast<osg::DoubleArray*>(getDepthArray());
+    const int nrVals = sz.x() * sz.y();
+    if(!depthVals || nrVals <= 0 || (int) depthVals->size() < nrVals)
+        return 0;
+
+    osg::Image *img = new osg::Image();
     const int depth = 1;
-    img->allocateImage(sz.y(), sz.x(), depth, GL_RGB, GL_UNSIGNED_BYTE);
+    img->allocateImage(sz.y(), sz.x(), depth, GL_RGBA, GL_UNSIGNED_BYTE);
 
-    osg::DoubleArray *depthVals = dynamic_cast<osg::DoubleArray*>(getDepthArray());
     double min = +999999;
     double max = -999999;
-    for(int j = 0; j < sz.y(); ++j)
+    for(int idx = 0; idx < nrVals; ++idx)
     {
-        for(int i = 0; i < sz.x(); ++i)
-        {
-            const double val = depthVals->at(j * sz.x() + i);
-            if(isUndef(val))
-                continue;
-            min = std::min(val, min);
-            max = std::max(val, max);
-        }
+        const double val = (*depthVals)[idx];
+        if(isUndef(val))
+            continue;
+        min = std::min(val, min);
+        max = std::max(val, max);
     }
 
     Palette p;
+    ColorTable table;
+    p.bakeTable(table);
 
-    GLubyte *ptr = img->data();
-    for(int j = 0; j < sz.y(); ++j)
-    {
-        for(int i = 0; i < sz.x(); ++i)
-        {
-            const double val = depthVals->at(j * sz.x() + i);
-
-            osg::Vec3 c = p.get(val, min, max);
-            *(ptr + 0) = GLubyte(c.x() * 255.0);
-            *(ptr + 1) = GLubyte(c.y() * 255.0);
-            *(ptr + 2) = GLubyte(c.z() * 255.0);
-            ptr += 3;
-        }
-    }
+    // undefined values have always been shown in the colour of the maximum
+    Palette::applyTable(table, &(*depthVals)[0], nrVals, min, max,
+                        getMaxDepth(), table.back(), img->data());
     return img;
 }
 
+
 void Horizon3DNode::updateGeometry()
 {
     if(getDepthArray()->getType() != osg::Array::DoubleArrayType)
@@ -581,6 +582,7 @@ void Horizon3DNode::updateGeometry()
     _texture->assignTextureUnits();
 
     data.laytex = _texture.get();
+    data.extrasStateSet = _extrasStateSet.get();
 
     const int numCPUs = OpenThreads::GetNumberOfProcessors();
     std::vector<Horizon3DTesselator*> threads(numCPUs);
@@ -21,9 +21,12 @@
 
 #include <osg/Geometry>
 #include <osg/Geode>
+#include <osg/Group>
 #include <osg/Texture2D>
 #include <osg/BoundingBox>
 
+#include <OpenThreads/Thread>
+
 #include <osgGeo/Vec2i>
 #include <osgGeo/Palette>
 #include <osgGeo/ShaderUtility.h>
@@ -50,22 +53,442 @@ private:
 
 };
 
+osg::Geometry *createGridGeometry(osg::Vec3Array *vertices, osg::Vec2Array *tCoords,
+                                  osg::Vec4Array *colors, osg::DrawElementsUShort *indices)
+{
+    osg::Geometry *geom = new osg::Geometry;
+    geom->setUseDisplayList(false);
+    geom->setUseVertexBufferObjects(true);
+    geom->setVertexArray(vertices);
+    geom->setTexCoordArray(0, tCoords);
+    geom->addPrimitiveSet(indices);
+    geom->setColorArray(colors);
+    geom->setColorBinding(osg::Geometry::BIND_OVERALL);
+    return geom;
+}
+
+// Resolution level l of a tile samples every 2^l-th grid position,
+// the last position of the tile is always included.
+const int resolutionsNum = 4;
+
+int getNumLevelSamples(int size, int compr)
+{
+    return (size - 2) / compr + 2;
+}
+
+int getLevelSample(int k, int size, int compr)
+{
+    return std::min(k * compr, size - 1);
+}
+
+/**
+  * Finds minimum and maximum of the defined depth values in a range
+  * of grid rows. Rows are contiguous in the depth array.
+  */
+class DepthRangeFinder : public OpenThreads::Thread
+{
+public:
+    DepthRangeFinder(const double *depthVals, int rowSize, float maxDepth,
+                     int firstRow, int lastRow) :
+        _depthVals(depthVals),
+        _rowSize(rowSize),
+        _maxDepth(maxDepth),
+        _firstRow(firstRow),
+        _lastRow(lastRow),
+        _min(+999999.0),
+        _max(-999999.0)
+    {}
+
+    virtual void run()
+    {
+        const double *ptr = _depthVals + _firstRow * _rowSize;
+        const double *stop = _depthVals + _lastRow * _rowSize;
+        for(; ptr < stop; ++ptr)
+        {
+            const double val = *ptr;
+            if(val >= _maxDepth)
+                continue;
+            _min = std::min(val, _min);
+            _max = std::max(val, _max);
+        }
+    }
+
+    double getMin() const { return _min; }
+    double getMax() const { return _max; }
+
+private:
+    const double *_depthVals;
+    int _rowSize;
+    float _maxDepth;
+    int _firstRow, _lastRow;
+    double _min, _max;
+};
+
+/**
+  * Builds the textures of a number of tiles, and for tiles with
+  * undefined positions the triangles of the shared grids that are
+  * fully defined, per resolution level. The geometry is assembled
+  * afterwards by the calling thread.
+  */
+class Horizon3DTileBuilder2 : public OpenThreads::Thread
+{
+public:
+    struct CommonData
+    {
+        const double *depthVals;
+        Vec2i fullSize;
+        float maxDepth;
+        double min, diff;
+        Vec2i tileSize;
+        int numHTiles, numVTiles;
+        osg::Vec2d origin, iInc, jInc;
+        const osg::Vec3Array *vertices; // vertices of the full resolution grid
+    };
+
+    struct Result
+    {
+        Result(int hI, int vI) :
+            hIdx(hI), vIdx(vI), hSize2(0), vSize2(0), hasUndefs(false) {}
+
+        // indexes of the tile within the horizon
+        int hIdx, vIdx;
+        // number of defined grid positions within the tile
+        int hSize2, vSize2;
+        bool hasUndefs;
+        osg::ref_ptr<osg::StateSet> stateSet;
+        // only set if hasUndefs, indexes into the shared grid per level
+        osg::ref_ptr<osg::DrawElementsUShort> indices[resolutionsNum];
+    };
+
+    Horizon3DTileBuilder2(const CommonData &data) : _data(data) {}
+
+    void addJob(int hIdx, int vIdx) { _results.push_back(Result(hIdx, vIdx)); }
+    virtual void run();
+
+    const std::vector<Result> &getResults() const { return _results; }
+
+private:
+    bool isUndef(double val) const { return val >= _data.maxDepth; }
+    void buildTile(Result &tile);
+
+    const CommonData &_data;
+    std::vector<Result> _results;
+};
+
+void Horizon3DTileBuilder2::run()
+{
+    for(unsigned int idx = 0; idx < _results.size(); ++idx)
+        buildTile(_results[idx]);
+}
+
+// Octahedral encoding of a unit vector into [0..USHRT_MAX]^2,
+// see horizon3d_vert.glsl for decoding.
+void encodeNormal(const osg::Vec3 &norm, unsigned short *out)
+{
+    const float l1 = fabs(norm.x()) + fabs(norm.y()) + fabs(norm.z());
+    float x = l1 > 0 ? norm.x() / l1 : 0.0f;
+    float y = l1 > 0 ? norm.y() / l1 : 0.0f;
+    if(norm.z() < 0)
+    {
+        const float xFold = (1.0f - fabs(y)) * (x >= 0 ? 1.0f : -1.0f);
+        const float yFold = (1.0f - fabs(x)) * (y >= 0 ? 1.0f : -1.0f);
+        x = xFold;
+        y = yFold;
+    }
+
+    #define C_USHRT_MAX_OVER_2 (USHRT_MAX * 0.5)
+    out[0] = (unsigned short)((x + 1.0) * C_USHRT_MAX_OVER_2 + 0.5);
+    out[1] = (unsigned short)((y + 1.0) * C_USHRT_MAX_OVER_2 + 0.5);
+}
+
+void Horizon3DTileBuilder2::buildTile(Result &tile)
+{
+    const CommonData &data = _data;
+    const Vec2i &fullSize = data.fullSize;
+    const Vec2i &tileSize = data.tileSize;
+    const double *depthVals = data.depthVals;
+    const osg::Vec3Array &vertices = *data.vertices;
+    const int hIdx = tile.hIdx;
+    const int vIdx = tile.vIdx;
+
+    const int compr = 1;
+
+    const int hSize = tileSize.x() + 1;
+    const int vSize = tileSize.y() + 1;
+
+    const int hSize2 = hIdx < (data.numHTiles - 1) ?
+                (tileSize.x() + 1) : (fullSize.x() - tileSize.x() * (data.numHTiles - 1)) / compr;
+    const int vSize2 = vIdx < (data.numVTiles - 1) ?
+                (tileSize.y() + 1) : ((fullSize.y() - tileSize.y() * (data.numVTiles - 1))) / compr;
+
+    tile.hSize2 = hSize2;
+    tile.vSize2 = vSize2;
+
+    if(hSize2 == 1 || vSize2 == 1)
+        return;
+
+    const int i1 = hIdx * tileSize.x();
+    const int j1 = vIdx * tileSize.y();
+    const osg::Vec2d start = data.origin + data.iInc * i1 + data.jInc * j1;
+    const osg::Vec3 shift(start.x(), start.y(), 0);
+
+    osg::ref_ptr<osg::Vec3Array> triangleNormals =
+            new osg::Vec3Array((hSize - 1) * (vSize - 1) * 2);
+
+    for(int i = 0; i < hSize - 1; ++i)
+        for(int j = 0; j < vSize - 1; ++j)
+        {
+            if((i < hSize2 - 1) && (j < vSize2 - 1))
+            {
+                int iGlobal = hIdx * tileSize.x() + i;
+                int jGlobal = vIdx * tileSize.y() + j;
+
+                const int i00 = i*vSize+j;
+                const int i10 = (i+1)*vSize+j;
+                const int i01 = i*vSize+(j+1);
+                const int i11 = (i+1)*vSize+(j+1);
+
+                osg::Vec3 v00 = vertices[i00] + shift;
+                osg::Vec3 v10 = vertices[i10] + shift;
+                osg::Vec3 v01 = vertices[i01] + shift;
+                osg::Vec3 v11 = vertices[i11] + shift;
+
+                const int i00_Global = iGlobal * fullSize.y() + jGlobal;
+                const int i10_Global = (iGlobal+1) * fullSize.y() + jGlobal;
+                const int i01_Global = iGlobal * fullSize.y() + (jGlobal+1);
+                const int i11_Global = (iGlobal+1) * fullSize.y() + (jGlobal+1);
+
+                v00.z() = depthVals[i00_Global];
+                v10.z() = depthVals[i10_Global];
+                v01.z() = depthVals[i01_Global];
+                v11.z() = depthVals[i11_Global];
+
+                if(isUndef(v10.z()) || isUndef(v01.z()))
+                    continue;
+
+                // calculate triangle normals
+                osg::Vec3 norm1 = (v01 - v00) ^ (v10 - v00);
+                norm1.normalize();
+                (*triangleNormals)[(i*(vSize-1)+j)*2] = norm1;
+
+                osg::Vec3 norm2 = (v10 - v11) ^ (v01 - v11);
+                norm2.normalize();
+                (*triangleNormals)[(i*(vSize-1)+j)*2+1] = norm2;
+            }
+        }
+
+    // One texel per grid position: R is the normalized 16 bit depth,
+    // G and B the octahedral encoded normal and A the undefined flag.
+    osg::ref_ptr<osg::Image> image = new osg::Image;
+    image->allocateImage(hSize, vSize, 1, GL_RGBA, GL_UNSIGNED_SHORT);
+    image->setInternalTextureFormat(GL_RGBA16);
+
+    const double depthScale = data.diff > 0 ? USHRT_MAX / data.diff : 0.0;
+
+    unsigned short *ptr = reinterpret_cast<unsigned short*>(image->data());
+    bool hasUndefs = false;
+    // defined flags in grid order (i*vSize+j)
+    std::vector<unsigned char> defined(hSize * vSize, 0);
+
+    // The following loop calculates normals per vertex. Because
+    // each vertex might be shared between many triangles(up to 6)
+    // we find out which triangles this particular vertex is shared
+    // and then compute the average of normals per triangle.
+    osg::Vec3 triNormCache[6];
+    for(int j = 0; j < vSize; ++j)
+    {
+        for(int i = 0; i < hSize; ++i, ptr += 4)
+        {
+            if((i < hSize2) && (j < vSize2))
+            {
+                int iGlobal = hIdx * tileSize.x() + i;
+                int jGlobal = vIdx * tileSize.y() + j;
+                double val = depthVals[iGlobal * fullSize.y() + jGlobal];
+                if(!isUndef(val))
+                {
+                    int k = 0;
+
+                    const int vSizeT = vSize - 1;
+
+                    // 3
+                    if((i < hSize - 1) && (j < vSize - 1))
+                    {
+                        triNormCache[k++] = (*triangleNormals)[(i*vSizeT+j)*2];
+                    }
+
+                    // 4, 5
+                    if(i > 0 && j < vSize - 1)
+                    {
+                        triNormCache[k++] = (*triangleNormals)[((i-1)*vSizeT+j)*2];
+                        triNormCache[k++] = (*triangleNormals)[((i-1)*vSizeT+j)*2+1];
+                    }
+
+                    // 1, 2
+                    if(j > 0 && i < hSize - 1)
+                    {
+                        triNormCache[k++] = (*triangleNormals)[(i*vSizeT+j-1)*2];
+                        triNormCache[k++] = (*triangleNormals)[(i*vSizeT+j-1)*2+1];
+                    }
+
+                    // 6
+                    if(i > 0 && j > 0)
+                    {
+                        triNormCache[k++] = (*triangleNormals)[((i-1)*vSizeT+j-1)*2+1];
+                    }
+
+                    osg::Vec3 norm;
+                    for(int l = 0; l < k; ++l)
+                        norm += triNormCache[l];
+
+                    norm.normalize();
+
+                    ptr[0] = (unsigned short)((val - data.min) * depthScale + 0.5);
+                    encodeNormal(norm, ptr + 1);
+                    ptr[3] = 0;
+                    defined[i*vSize+j] = 1;
+                    continue;
+                }
+            }
+
+            ptr[0] = ptr[1] = ptr[2] = 0;
+            ptr[3] = USHRT_MAX;
+            hasUndefs = true;
+        }
+    }
+
+    // Texture coordinates of the grid hit texel centres, so no
+    // filtering is needed.
+    osg::ref_ptr<osg::Texture2D> heightMap = new osg::Texture2D;
+    heightMap->setImage(image.get());
+    heightMap->setFilter(osg::Texture::MIN_FILTER, osg::Texture::NEAREST);
+    heightMap->setFilter(osg::Texture::MAG_FILTER, osg::Texture::NEAREST);
+    heightMap->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    heightMap->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+
+    osg::ref_ptr<osg::StateSet> ss = new osg::StateSet;
+    ss->setTextureAttributeAndModes(1, heightMap.get());
+
+    tile.stateSet = ss;
+    tile.hasUndefs = hasUndefs;
+
+    if(!hasUndefs)
+        return;
+
+    // leave out the triangles with undefined vertices
+    for(int resLevel = 0; resLevel < resolutionsNum; ++resLevel)
+    {
+        const int compr = 1 << resLevel;
+        const int hNum = getNumLevelSamples(hSize, compr);
+        const int vNum = getNumLevelSamples(vSize, compr);
+
+        osg::ref_ptr<osg::DrawElementsUShort> indices =
+                new osg::DrawElementsUShort(GL_TRIANGLES);
+        for(int i = 0; i < hNum - 1; ++i)
+        {
+            const int iPos0 = getLevelSample(i, hSize, compr);
+            const int iPos1 = getLevelSample(i + 1, hSize, compr);
+            if(iPos1 >= hSize2)
+                break;
+
+            for(int j = 0; j < vNum - 1; ++j)
+            {
+                const int jPos0 = getLevelSample(j, vSize, compr);
+                const int jPos1 = getLevelSample(j + 1, vSize, compr);
+                if(jPos1 >= vSize2)
+                    break;
+
+                // both triangles share this edge
+                if(!defined[iPos1*vSize+jPos0] || !defined[iPos0*vSize+jPos1])
+                    continue;
+
+                const int i00 = i*vNum+j;
+                const int i10 = (i+1)*vNum+j;
+                const int i01 = i*vNum+(j+1);
+                const int i11 = (i+1)*vNum+(j+1);
+
+                // first triangle
+                if(defined[iPos0*vSize+jPos0])
+                {
+                    indices->push_back(i00);
+                    indices->push_back(i10);
+                    indices->push_back(i01);
+                }
+
+                // second triangle
+                if(defined[iPos1*vSize+jPos1])
+                {
+                    indices->push_back(i10);
+                    indices->push_back(i01);
+                    indices->push_back(i11);
+                }
+            }
+        }
+
+        tile.indices[resLevel] = indices;
+    }
+}
+
 }
 
 Horizon3DTileNode2::Horizon3DTileNode2()
 {
+    _nodes.resize(resolutionsNum);
 }
 
 void Horizon3DTileNode2::traverse(osg::NodeVisitor &nv)
 {
     if(nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR)
     {
-        _nodes.at(0)->accept(nv);
+        // the cull visitor has already applied our matrix,
+        // so the center has to be in local coordinates
+        const osg::Vec3 center = getBound().center() - getMatrix().getTrans();
+        const float distance = nv.getDistanceToViewPoint(center, true);
+
+        const std::vector<osg::Vec2d> coords = getCornerCoords();
+        const float iDen = ((coords[2] - coords[0]) / getSize().x()).length();
+        const float jDen = ((coords[1] - coords[0]) / getSize().y()).length();
+
+        const float k = std::min(iDen, jDen);
+        const float threshold1 = k * 2000.0;
+        const float threshold2 = k * 8000.0;
+        const float threshold3 = k * 16000.0;
+
+        int lod = 3;
+        if(distance < threshold1)
+            lod = 0;
+        else if(distance < threshold2)
+            lod = 1;
+        else if(distance < threshold3)
+            lod = 2;
+
+        if(_nodes[lod].valid())
+            _nodes[lod]->accept(nv);
     }
 }
 
 Horizon3DNode2::Horizon3DNode2()
 {
+    initStateSets();
+}
+
+void Horizon3DNode2::initStateSets()
+{
+    _depthMinUniform = new osg::Uniform("depthMin", 0.0f);
+    _depthDiffUniform = new osg::Uniform("depthDiff", 1.0f);
+
+    // apply vertex shader to shift geometry
+    _stateSet = new osg::StateSet;
+    _stateSet->addUniform(new osg::Uniform("colour", osg::Vec4(0.0f, 0.0f, 1.0f, 1.0f)));
+    _stateSet->addUniform(_depthMinUniform.get());
+    _stateSet->addUniform(_depthDiffUniform.get());
+    _stateSet->addUniform(new osg::Uniform("heightMap", 1));
+    // all horizons share the program through the ShaderUtility cache
+    ShaderUtility su;
+    osg::ref_ptr<osg::Program> program = su.createProgram("horizon3d_vert.glsl", "horizon3d_frag.glsl");
+    _stateSet->setAttributeAndModes(program.get(), osg::StateAttribute::ON);
+
+    const Palette p;
+    p.addColorPointUniforms(*_stateSet);
 }
 
 void Horizon3DNode2::updateGeometry()
@@ -74,17 +497,31 @@ void Horizon3DNode2::updateGeometry()
 
     osg::DoubleArray &depthVals = *dynamic_cast<osg::DoubleArray*>(getDepthArray());
 
+    const int numCPUs = std::max(OpenThreads::GetNumberOfProcessors(), 1);
+
+    // Global depth range. Each thread scans a contiguous block of rows.
     double min = +999999.0;
     double max = -999999.0;
-    for(int j = 0; j < fullSize.x(); ++j)
     {
-        for(int i = 0; i < fullSize.y(); ++i)
+        const int numThreads = std::min(numCPUs, fullSize.x());
+        std::vector<DepthRangeFinder*> finders;
+        for(int i = 0; i < numThreads; ++i)
         {
-            const double val = depthVals.at(i * fullSize.y() + j);
-            if(isUndef(val))
-                continue;
-            min = std::min(val, min);
-            max = std::max(val, max);
+            const int firstRow = fullSize.x() * i / numThreads;
+            const int lastRow = fullSize.x() * (i + 1) / numThreads;
+            finders.push_back(new DepthRangeFinder(&depthVals.front(), fullSize.y(),
+                                                   getMaxDepth(), firstRow, lastRow));
+        }
+
+        for(unsigned int i = 0; i < finders.size(); ++i)
+            finders[i]->startThread();
+
+        for(unsigned int i = 0; i < finders.size(); ++i)
+        {
+            finders[i]->join();
+            min = std::min(finders[i]->getMin(), min);
+            max = std::max(finders[i]->getMax(), max);
+            delete finders[i];
         }
     }
     const double diff = max - min;
@@ -96,286 +533,182 @@ void Horizon3DNode2::updateGeometry()
 
     const osgGeo::Vec2i tileSize(255, 255);
 
-    const int compr = 1;
-
     const int hSize = tileSize.x() + 1;
     const int vSize = tileSize.y() + 1;
 
-    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array(hSize * vSize);
-    osg::ref_ptr<osg::DrawElementsUInt> indices =
-            new osg::DrawElementsUInt(GL_TRIANGLES);
-    osg::ref_ptr<osg::Vec2Array> tCoords = new osg::Vec2Array(hSize * vSize);
+    osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+    colors->push_back(osg::Vec4(1.0f, 0.0f, 1.0f, 1.0f)); // needs to be white!
 
-    osg::Vec2 texStart(0.0, 0.0);
-    osg::Vec2 textureTileStep(1.0, 1.0);
+    // one grid per resolution level, shared by all tiles
+    osg::ref_ptr<osg::Vec3Array> vertices[resolutionsNum];
+    osg::ref_ptr<osg::Vec2Array> tCoords[resolutionsNum];
+    osg::ref_ptr<osg::Geode> gridGeodes[resolutionsNum];
 
-    for(int i = 0; i < hSize; ++i)
+    for(int resLevel = 0; resLevel < resolutionsNum; ++resLevel)
     {
-        for(int j = 0; j < vSize; ++j)
+        const int compr = 1 << resLevel;
+        const int hNum = getNumLevelSamples(hSize, compr);
+        const int vNum = getNumLevelSamples(vSize, compr);
+
+        vertices[resLevel] = new osg::Vec3Array(hNum * vNum);
+        tCoords[resLevel] = new osg::Vec2Array(hNum * vNum);
+        osg::ref_ptr<osg::DrawElementsUShort> indices =
+                new osg::DrawElementsUShort(GL_TRIANGLES);
+
+        // coarse levels sample full resolution texel centres,
+        // so no mipmaps are needed
+        for(int i = 0; i < hNum; ++i)
         {
-            osg::Vec2d hor = iInc * i + jInc * j;
-            (*vertices)[i*vSize+j] = osg::Vec3(hor.x(), hor.y(), 0);
-            (*tCoords)[i*vSize+j] = texStart + osg::Vec2(
-                        float(i) / (hSize - 1) * textureTileStep.x(),
-                        float(j) / (vSize - 1) * textureTileStep.y()
-                        );
+            const int iPos = getLevelSample(i, hSize, compr);
+            for(int j = 0; j < vNum; ++j)
+            {
+                const int jPos = getLevelSample(j, vSize, compr);
+                osg::Vec2d hor = iInc * iPos + jInc * jPos;
+                (*vertices[resLevel])[i*vNum+j] = osg::Vec3(hor.x(), hor.y(), 0);
+                (*tCoords[resLevel])[i*vNum+j] = osg::Vec2(
+                            (iPos + 0.5f) / hSize,
+                            (jPos + 0.5f) / vSize
+                            );
+            }
         }
-    }
 
-    for(int i = 0; i < hSize - 1; ++i)
-    {
-        for(int j = 0; j < vSize - 1; ++j)
+        for(int i = 0; i < hNum - 1; ++i)
         {
-            const int i00 = i*vSize+j;
-            const int i10 = (i+1)*vSize+j;
-            const int i01 = i*vSize+(j+1);
-            const int i11 = (i+1)*vSize+(j+1);
-
-            // first triangle
-            indices->push_back(i00);
-            indices->push_back(i10);
-            indices->push_back(i01);
-
-            // second triangle
-            indices->push_back(i10);
-            indices->push_back(i01);
-            indices->push_back(i11);
+            for(int j = 0; j < vNum - 1; ++j)
+            {
+                const int i00 = i*vNum+j;
+                const int i10 = (i+1)*vNum+j;
+                const int i01 = i*vNum+(j+1);
+                const int i11 = (i+1)*vNum+(j+1);
+
+                // first triangle
+                indices->push_back(i00);
+                indices->push_back(i10);
+                indices->push_back(i01);
+
+                // second triangle
+                indices->push_back(i10);
+                indices->push_back(i01);
+                indices->push_back(i11);
+            }
         }
-    }
 
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
-    geom->setVertexArray(vertices.get());
-    geom->setTexCoordArray(0, tCoords.get());
-    geom->addPrimitiveSet(indices.get());
+        gridGeodes[resLevel] = new osg::Geode;
+        gridGeodes[resLevel]->addDrawable(createGridGeometry(vertices[resLevel].get(),
+                                                             tCoords[resLevel].get(),
+                                                             colors.get(), indices.get()));
+    }
 
-    osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
-    colors->push_back(osg::Vec4(1.0f, 0.0f, 1.0f, 1.0f)); // needs to be white!
+    // ------------- geom finished ----------------
 
-    geom->setColorArray(colors.get());
-    geom->setColorBinding(osg::Geometry::BIND_OVERALL);
+    _depthMinUniform->set(float(min));
+    _depthDiffUniform->set(float(diff));
+
+    Horizon3DTileBuilder2::CommonData data;
+    data.depthVals = &depthVals.front();
+    data.fullSize = fullSize;
+    data.maxDepth = getMaxDepth();
+    data.min = min;
+    data.diff = diff;
+    data.tileSize = tileSize;
+    data.numHTiles = ceil(float(fullSize.x()) / tileSize.x());
+    data.numVTiles = ceil(float(fullSize.y()) / tileSize.y());
+    data.origin = coords[0];
+    data.iInc = iInc;
+    data.jInc = jInc;
+    data.vertices = vertices[0].get();
+
+    // Tiles are built in parallel. Everything shared between tiles is
+    // attached below on this thread.
+    std::vector<Horizon3DTileBuilder2*> threads(numCPUs);
+    for(int i = 0; i < numCPUs; ++i)
+        threads[i] = new Horizon3DTileBuilder2(data);
+
+    int currentThread = 0;
+    for(int hIdx = 0; hIdx < data.numHTiles; ++hIdx)
+    {
+        for(int vIdx = 0; vIdx < data.numVTiles; ++vIdx)
+        {
+            threads[currentThread]->addJob(hIdx, vIdx);
+            currentThread++;
+            if(currentThread == numCPUs)
+                currentThread = 0;
+        }
+    }
 
-    // ------------- geom finished ----------------
+    for(int i = 0; i < numCPUs; ++i)
+        threads[i]->startThread();
 
-    ShaderUtility su;
-    su.addDefinition("hasGeomShader");
-    osg::Program* programGeom = su.createProgram("horizon3d_vert.glsl", "horizon3d_frag.glsl",
-                                                 "horizon3d_geom.glsl");
-    ShaderUtility su2;
-    osg::Program* programNonGeom = su2.createProgram("horizon3d_vert.glsl", "horizon3d_frag.glsl");
+    for(int i = 0; i < numCPUs; ++i)
+        threads[i]->join();
 
-    int numHTiles = ceil(float(fullSize.x()) / tileSize.x());
-    int numVTiles = ceil(float(fullSize.y()) / tileSize.y());
+    osg::ref_ptr<osg::Group> root = new osg::Group;
+    root->setStateSet(_stateSet.get());
 
-    for(int hIdx = 0; hIdx < numHTiles; ++hIdx)
+    for(int i = 0; i < numCPUs; ++i)
     {
-        for(int vIdx = 0; vIdx < numVTiles; ++vIdx)
+        const std::vector<Horizon3DTileBuilder2::Result> &tiles = threads[i]->getResults();
+        for(unsigned int j = 0; j < tiles.size(); ++j)
         {
-            const int hSize2 = hIdx < (numHTiles - 1) ?
-                        (tileSize.x() + 1) : (fullSize.x() - tileSize.x() * (numHTiles - 1)) / compr;
-            const int vSize2 = vIdx < (numVTiles - 1) ?
-                        (tileSize.y() + 1) : ((fullSize.y() - tileSize.y() * (numVTiles - 1))) / compr;
-
-            if(hSize2 == 1 || vSize2 == 1)
+            const Horizon3DTileBuilder2::Result &tile = tiles[j];
+            if(!tile.stateSet.valid())
                 continue;
 
-            osg::ref_ptr<osg::Image> image = new osg::Image;
-            image->allocateImage(vSize, hSize, 1, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE);
-            image->setInternalTextureFormat(GL_LUMINANCE8_ALPHA8);
-
-            unsigned short *ptr = reinterpret_cast<unsigned short*>(image->data());
-            bool hasUndefs = false;
-            for(int j = 0; j < vSize; ++j)
-            {
-                for(int i = 0; i < hSize; ++i)
-                {
-                    bool defined = false;
-                    if((i < hSize2) && (j < vSize2))
-                    {
-                        int iGlobal = hIdx * tileSize.x() + i;
-                        int jGlobal = vIdx * tileSize.y() + j;
-                        double val = depthVals.at(iGlobal * fullSize.y() + jGlobal);
-                        if(!isUndef(val))
-                        {
-                            *ptr = (val - min) / diff * UCHAR_MAX;
-                            defined = true;
-                        }
-                    }
-                    if(!defined)
-                    {
-                        *ptr = 0xFF00;
-                        hasUndefs = true;
-                    }
-                    ptr++;
-                }
-            }
+            // nothing defined in this tile
+            if(tile.hasUndefs && tile.indices[0]->empty())
+                continue;
 
-            const int i1 = hIdx * tileSize.x();
-            const int j1 = vIdx * tileSize.y();
+            const int i1 = tile.hIdx * tileSize.x();
+            const int j1 = tile.vIdx * tileSize.y();
             const osg::Vec2d start = coords[0] + iInc * i1 + jInc * j1;
-            const osg::Vec3 shift(start.x(), start.y(), 0);
-
-            osg::ref_ptr<osg::Texture2D> heightMap = new osg::Texture2D;
-            heightMap->setImage(image.get());
-
-            osg::ref_ptr<osg::Vec3Array> triangleNormals =
-                    new osg::Vec3Array((hSize - 1) * (vSize - 1) * 2);
 
-            for(int i = 0; i < hSize - 1; ++i)
-                for(int j = 0; j < vSize - 1; ++j)
-                {
-                    if((i < hSize2 - 1) && (j < vSize2 - 1))
-                    {
-                        int iGlobal = hIdx * tileSize.x() + i;
-                        int jGlobal = vIdx * tileSize.y() + j;
-
-                        const int i00 = i*vSize+j;
-                        const int i10 = (i+1)*vSize+j;
-                        const int i01 = i*vSize+(j+1);
-                        const int i11 = (i+1)*vSize+(j+1);
-
-                        osg::Vec3 v00 = (*vertices)[i00] + shift;
-                        osg::Vec3 v10 = (*vertices)[i10] + shift;
-                        osg::Vec3 v01 = (*vertices)[i01] + shift;
-                        osg::Vec3 v11 = (*vertices)[i11] + shift;
-
-                        const int i00_Global = iGlobal * fullSize.y() + jGlobal;
-                        const int i10_Global = (iGlobal+1) * fullSize.y() + jGlobal;
-                        const int i01_Global = iGlobal * fullSize.y() + (jGlobal+1);
-                        const int i11_Global = (iGlobal+1) * fullSize.y() + (jGlobal+1);
-
-                        v00.z() = depthVals.at(i00_Global);
-                        v10.z() = depthVals.at(i10_Global);
-                        v01.z() = depthVals.at(i01_Global);
-                        v11.z() = depthVals.at(i11_Global);
-
-                        if(isUndef(v10.z()) || isUndef(v01.z()))
-                            continue;
-
-                        // calculate triangle normals
-                        osg::Vec3 norm1 = (v01 - v00) ^ (v10 - v00);
-                        norm1.normalize();
-                        (*triangleNormals)[(i*(vSize-1)+j)*2] = norm1;
-
-                        osg::Vec3 norm2 = (v10 - v11) ^ (v01 - v11);
-                        norm2.normalize();
-                        (*triangleNormals)[(i*(vSize-1)+j)*2+1] = norm2;
-                    }
-                }
-
-            osg::Image *normalsImage = new osg::Image();
-            normalsImage->allocateImage(hSize, vSize, 1, GL_RGB, GL_UNSIGNED_BYTE);
-            GLubyte *normPtr = (GLubyte*)normalsImage->data();
+            osg::ref_ptr<Horizon3DTileNode2> transform = new Horizon3DTileNode2;
+            transform->setMatrix(osg::Matrix::translate(osg::Vec3(start, 0)));
+            // tile geodes may be shared, so the textures go on the transform
+            transform->setStateSet(tile.stateSet.get());
 
-            // The following loop calculates normals per vertex. Because
-            // each vertex might be shared between many triangles(up to 6)
-            // we find out which triangles this particular vertex is shared
-            // and then compute the average of normals per triangle.
-            osg::Vec3 triNormCache[6];
-            for(int j = 0; j < vSize; ++j)
+            for(int resLevel = 0; resLevel < resolutionsNum; ++resLevel)
             {
-                for(int i = 0; i < hSize; ++i)
+                if(!tile.hasUndefs)
                 {
-                    if((i < hSize2) && (j < vSize2))
-                    {
-                        int k = 0;
-
-                        const int vSizeT = vSize - 1;
-
-                        // 3
-                        if((i < hSize - 1) && (j < vSize - 1))
-                        {
-                            triNormCache[k++] = (*triangleNormals)[(i*vSizeT+j)*2];
-                        }
-
-                        // 4, 5
-                        if(i > 0 && j < vSize - 1)
-                        {
-                            triNormCache[k++] = (*triangleNormals)[((i-1)*vSizeT+j)*2];
-                            triNormCache[k++] = (*triangleNormals)[((i-1)*vSizeT+j)*2+1];
-                        }
-
-                        // 1, 2
-                        if(j > 0 && i < hSize - 1)
-                        {
-                            triNormCache[k++] = (*triangleNormals)[(i*vSizeT+j-1)*2];
-                            triNormCache[k++] = (*triangleNormals)[(i*vSizeT+j-1)*2+1];
-                        }
-
-                        // 6
-                        if(i > 0 && j > 0)
-                        {
-                            triNormCache[k++] = (*triangleNormals)[((i-1)*vSizeT+j-1)*2+1];
-                        }
-
-                        if(k > 0)
-                        {
-                            osg::Vec3 norm;
-                            for(int l = 0; l < k; ++l)
-                                norm += triNormCache[l];
-
-                            norm.normalize();
-
-                            // scale [-1;1] to [0..255]
-                            #define C_255_OVER_2 127.5
-                            *(normPtr + 0) = GLubyte((norm.x() + 1.0) * C_255_OVER_2);
-                            *(normPtr + 1) = GLubyte((norm.y() + 1.0) * C_255_OVER_2);
-                            *(normPtr + 2) = GLubyte((norm.z() + 1.0) * C_255_OVER_2);
-                        }
-                    }
-                    normPtr += 3;
+                    transform->setNode(resLevel, gridGeodes[resLevel].get());
+                    continue;
                 }
-            }
-
-            osg::ref_ptr<osg::Texture2D> normals = new osg::Texture2D;
-            normals->setImage(normalsImage);
 
-            osg::Geode* geode = new osg::Geode;
-            geode->addDrawable(geom.get());
-
-            // apply vertex shader to shift geometry
-            osg::StateSet *ss = geode->getOrCreateStateSet();
-            ss->addUniform(new osg::Uniform("colour", osg::Vec4(0.0f, 0.0f, 1.0f, 1.0f)));
-            ss->addUniform(new osg::Uniform("depthMin", float(min)));
-            ss->addUniform(new osg::Uniform("depthDiff", float(diff)));
-            ss->setTextureAttributeAndModes(1, heightMap.get());
-            ss->setTextureAttributeAndModes(2, normals.get());
-            ss->addUniform(new osg::Uniform("heightMap", 1));
-            ss->addUniform(new osg::Uniform("normals", 2));
-
-            const Palette p;
-            const int sz = p.colorPoints().size();
-
-            osg::Uniform *colourPoints = new osg::Uniform(osg::Uniform::FLOAT_VEC4, "colourPoints[0]", 20);
-            for(int i = 0; i < sz; ++i)
-            {
-                osg::Vec3 colour = p.colorPoints().at(i).color;
-                colourPoints->setElement(i, osg::Vec4(colour, 1.0));
-            }
-            ss->addUniform(colourPoints);
-            osg::Uniform *colourPositions = new osg::Uniform(osg::Uniform::FLOAT, "colourPositions[0]", 20);
-            for(int i = 0; i < sz; ++i)
-            {
-                colourPositions->setElement(i, p.colorPoints().at(i).pos);
+                // same vertices, compacted triangles
+                osg::Geode* geode = new osg::Geode;
+                geode->addDrawable(createGridGeometry(vertices[resLevel].get(),
+                                                      tCoords[resLevel].get(), colors.get(),
+                                                      tile.indices[resLevel].get()));
+                transform->setNode(resLevel, geode);
             }
-            ss->addUniform(colourPositions);
-            ss->addUniform(new osg::Uniform("paletteSize", sz));
 
-            ss->setAttributeAndModes(hasUndefs ? programGeom : programNonGeom, osg::StateAttribute::ON);
-
-            osg::ref_ptr<Horizon3DTileNode2> transform = new Horizon3DTileNode2;
-            transform->setMatrix(osg::Matrix::translate(osg::Vec3(start, 0)));
-            transform->setNode(0, geode);
+            std::vector<osg::Vec2d> tileCoords(3);
+            tileCoords[0] = start;
+            tileCoords[1] = start + jInc * (tile.vSize2 - 1);
+            tileCoords[2] = start + iInc * (tile.hSize2 - 1);
+            transform->setCornerCoords(tileCoords);
+            transform->setSize(Vec2i(tile.hSize2 - 1, tile.vSize2 - 1));
 
             // compute bounding box as our nodes don't have proper vertex information
             // and OSG can't deduce bounding sphere for culling
-            osg::BoundingBox bb(osg::Vec3(start, min),
-                                osg::Vec3(start + iInc * hSize2 + jInc * vSize2, max));
+            osg::BoundingBox bb;
+            bb.expandBy(osg::Vec3(tileCoords[0], min));
+            bb.expandBy(osg::Vec3(tileCoords[1], min));
+            bb.expandBy(osg::Vec3(tileCoords[2], min));
+            bb.expandBy(osg::Vec3(tileCoords[1] + tileCoords[2] - start, max));
             transform->setBoundingSphere(bb);
 
-            _nodes.push_back(transform);
+            root->addChild(transform.get());
         }
     }
 
+    _nodes.clear();
+    _nodes.push_back(root);
+
+    for(int i = 0; i < numCPUs; ++i)
+        delete threads[i];
+
     _needsUpdate = false;
 }
 
@@ -21,14 +21,25 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 #include <osg/BlendFunc>
 #include <osg/Geometry>
 #include <osg/State>
+#include <osg/TexMat>
 #include <osg/Texture2D>
 #include <osg/Version>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
 #include <osgUtil/CullVisitor>
 #include <osgGeo/Vec2i>
+#include <osgGeo/ShaderUtility.h>
 
 #include <string.h>
 #include <iostream>
 #include <cstdio>
+#include <list>
+#include <map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define NR_TEXTURE_UNITS 8
 
@@ -139,20 +150,71 @@ static int texture2ImageChannel( int channel, GLenum format )
 }
 
 
+/* Transparency scanners over nr channel values, step elements apart. They
+   return false as soon as a partly transparent value is found. */
+
+template <class T>
+static bool scanTransparencies( const T* ptr, int nr, int step, T transparent, T opaque, bool& foundTransparent, bool& foundOpaque )
+{
+    for ( int idx=0; idx<nr; idx++, ptr+=step )
+    {
+	if ( *ptr<=transparent )
+	    foundTransparent = true;
+	else if ( *ptr>=opaque )
+	    foundOpaque = true;
+	else
+	    return false;
+    }
+
+    return true;
+}
+
+
+static bool scanByteTransparencies( const unsigned char* ptr, int nr, int step, bool& foundTransparent, bool& foundOpaque )
+{
+    int idx = 0;
+
+#ifdef __SSE2__
+    if ( step==1 || step==2 || step==4 )
+    {
+	// Channel values at every step-th byte of a 16-byte load
+	const int laneMask = step==1 ? 0xFFFF : ( step==2 ? 0x5555 : 0x1111 );
+	const int nrPerLoad = 16/step;
+	const __m128i zeros = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8( (char) 0xFF );
+
+	// Keep one pixel spare, as the load passes the last channel value
+	for ( ; idx+nrPerLoad<nr; idx+=nrPerLoad, ptr+=16 )
+	{
+	    const __m128i vals = _mm_loadu_si128( (const __m128i*) ptr );
+	    const int isZero = laneMask &
+			_mm_movemask_epi8( _mm_cmpeq_epi8(vals,zeros) );
+	    const int isOne = laneMask &
+			_mm_movemask_epi8( _mm_cmpeq_epi8(vals,ones) );
+
+	    if ( (isZero|isOne) != laneMask )
+		return false;
+	    if ( isZero )
+		foundTransparent = true;
+	    if ( isOne )
+		foundOpaque = true;
+	}
+    }
+#endif
+
+    return scanTransparencies<unsigned char>( ptr, nr-idx, step, 0, 255,
+					      foundTransparent, foundOpaque );
+}
+
+
 static TransparencyType getTransparencyTypeBytewise( const unsigned char* start, const unsigned char* stop, int step )
 {
     bool foundOpaquePixel = false;
     bool foundTransparentPixel = false;
 
-    for ( const unsigned char* ptr=start; ptr<=stop; ptr+=step )
-    {
-	if ( *ptr==0 )
-	    foundTransparentPixel = true;
-	else if ( *ptr==255 )
-	    foundOpaquePixel = true;
-	else
-	    return HasTransparencies;
-    }
+    if ( !scanByteTransparencies(start, (stop-start)/step+1, step,
+				 foundTransparentPixel, foundOpaquePixel) )
+	return HasTransparencies;
 
     if ( foundTransparentPixel )
 	return foundOpaquePixel ? OnlyFullTransparencies : FullyTransparent;
@@ -161,8 +223,71 @@ static TransparencyType getTransparencyTypeBytewise( const unsigned char* start,
 }
 
 
-static TransparencyType getImageTransparencyType( const osg::Image* image, int textureChannel=3 )
-{                                                                               
+static bool scanShortTransparencies( const unsigned short* ptr, int nr, int step, bool& foundTransparent, bool& foundOpaque )
+{
+    int idx = 0;
+
+#ifdef __SSE2__
+    if ( step==1 )
+    {
+	const __m128i zeros = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi16( (short) 0xFFFF );
+
+	for ( ; idx+8<=nr; idx+=8, ptr+=8 )
+	{
+	    const __m128i vals = _mm_loadu_si128( (const __m128i*) ptr );
+	    const int isZero = _mm_movemask_epi8( _mm_cmpeq_epi16(vals,zeros) );
+	    const int isOne = _mm_movemask_epi8( _mm_cmpeq_epi16(vals,ones) );
+
+	    if ( (isZero|isOne) != 0xFFFF )
+		return false;
+	    if ( isZero )
+		foundTransparent = true;
+	    if ( isOne )
+		foundOpaque = true;
+	}
+    }
+#endif
+
+    return scanTransparencies<unsigned short>( ptr, nr-idx, step, 0, 65535,
+					       foundTransparent, foundOpaque );
+}
+
+
+static bool scanFloatTransparencies( const float* ptr, int nr, int step, bool& foundTransparent, bool& foundOpaque )
+{
+    int idx = 0;
+
+#ifdef __SSE2__
+    if ( step==1 )
+    {
+	const __m128 zeros = _mm_setzero_ps();
+	const __m128 ones = _mm_set1_ps( 1.0f );
+
+	for ( ; idx+4<=nr; idx+=4, ptr+=4 )
+	{
+	    const __m128 vals = _mm_loadu_ps( ptr );
+	    const int isZero = _mm_movemask_ps( _mm_cmple_ps(vals,zeros) );
+	    const int isOne = _mm_movemask_ps( _mm_cmpge_ps(vals,ones) );
+
+	    // NaN compares false with both, as it does in the scalar scan
+	    if ( (isZero|isOne) != 0xF )
+		return false;
+	    if ( isZero )
+		foundTransparent = true;
+	    if ( isOne )
+		foundOpaque = true;
+	}
+    }
+#endif
+
+    return scanTransparencies<float>( ptr, nr-idx, step, 0.0f, 1.0f,
+				      foundTransparent, foundOpaque );
+}
+
+
+static TransparencyType getImageTransparencyType( const osg::Image* image, int textureChannel, int s0, int t0, int width, int height )
+{
     if ( !image )
 	return FullyTransparent;
 
@@ -173,35 +298,55 @@ static TransparencyType getImageTransparencyType( const osg::Image* image, int t
 	return FullyTransparent;
     if ( imageChannel==ONE_CHANNEL )
 	return Opaque;
+    if ( imageChannel<0 )
+	return HasTransparencies;
 
-    GLenum dataType = image->getDataType();                               
-    bool isByte = dataType==GL_UNSIGNED_BYTE || dataType==GL_BYTE;
-
-    if ( isByte && imageChannel>=0 )
-    {
-	const int step = image->getPixelSizeInBits()/8;
-	const unsigned char* start = image->data()+imageChannel;
-	const unsigned char* stop = start+image->getTotalSizeInBytes()-step;
-	return getTransparencyTypeBytewise( start, stop, step ); 
-    }
+    const GLenum dataType = image->getDataType();
+    const int pixelSize = image->getPixelSizeInBits()/8;
 
     bool foundOpaquePixel = false;
     bool foundTransparentPixel = false;
 
     for ( int r=image->r()-1; r>=0; r-- )
     {
-	for ( int t=image->t()-1; t>=0; t-- )
+	for ( int t=t0+height-1; t>=t0; t-- )
 	{
-	    for ( int s=image->s()-1; s>=0; s-- )
+	    const unsigned char* row = image->data( s0, t, r );
+	    bool noPartials = true;
+
+	    if ( dataType==GL_UNSIGNED_BYTE || dataType==GL_BYTE )
 	    {
-		const float val = image->getColor(s,t,r)[imageChannel];
-		if ( val<=0.0f )
-		    foundTransparentPixel = true;
-		else if ( val>=1.0f )
-		    foundOpaquePixel = true;
-		else
-		    return HasTransparencies;
+		noPartials = scanByteTransparencies( row+imageChannel, width,
+			pixelSize, foundTransparentPixel, foundOpaquePixel );
+	    }
+	    else if ( dataType==GL_UNSIGNED_SHORT )
+	    {
+		noPartials = scanShortTransparencies(
+			(const unsigned short*) row + imageChannel, width,
+			pixelSize/2, foundTransparentPixel, foundOpaquePixel );
+	    }
+	    else if ( dataType==GL_FLOAT )
+	    {
+		noPartials = scanFloatTransparencies(
+			(const float*) row + imageChannel, width,
+			pixelSize/4, foundTransparentPixel, foundOpaquePixel );
+	    }
+	    else
+	    {
+		for ( int s=s0+width-1; s>=s0 && noPartials; s-- )
+		{
+		    const float val = image->getColor(s,t,r)[imageChannel];
+		    if ( val<=0.0f )
+			foundTransparentPixel = true;
+		    else if ( val>=1.0f )
+			foundOpaquePixel = true;
+		    else
+			noPartials = false;
+		}
 	    }
+
+	    if ( !noPartials )
+		return HasTransparencies;
 	}
     }
 
@@ -212,6 +357,21 @@ static TransparencyType getImageTransparencyType( const osg::Image* image, int t
 }
 
 
+static TransparencyType mergeTransparencies( TransparencyType tt1, TransparencyType tt2 )
+{
+    if ( tt1==TransparencyUnknown || tt2==TransparencyUnknown )
+	return TransparencyUnknown;
+
+    if ( tt1==tt2 )
+	return tt1;
+
+    if ( tt1==HasTransparencies || tt2==HasTransparencies )
+	return HasTransparencies;
+
+    return OnlyFullTransparencies;
+}
+
+
 static TransparencyType addOpacity( TransparencyType tt, float opacity )
 {
     if ( tt==TransparencyUnknown )
@@ -306,6 +466,12 @@ struct LayeredTextureData : public osg::Referenced
 			    , _borderColorSource( 1.0f, 1.0f, 1.0f, 1.0f )
 			    , _undefColorSource( -1.0f, -1.0f, -1.0f, -1.0f )
 			    , _undefColor( -1.0f, -1.0f, -1.0f, -1.0f )
+			    , _dirtySize( 0, 0 )
+			    , _subImageModified( false )
+			    , _tileSourceData( 0 )
+			    , _contentVersion( 0 )
+			    , _packLayerId( -1 )
+			    , _packChannel( -1 )
 			{
 			    for ( int idx=0; idx<4; idx++ )
 				_undefChannelRefCount[idx] = 0;
@@ -316,9 +482,27 @@ struct LayeredTextureData : public osg::Referenced
     LayeredTextureData*	clone() const;
     osg::Vec2f		getLayerCoord(const osg::Vec2f& global) const;
     osg::Vec4f		getTextureVec(const osg::Vec2f& global) const;
+    void		getTextureVecSpan(const osg::Vec2f& globalStart,
+					  const osg::Vec2f& globalStep,int nr,
+					  osg::Vec4f* res) const;
     void		clearTransparencyType();
     void		adaptColors();
     void		cleanUp();
+    bool		hasDirtyRect() const;
+    bool		isTileDirty(const osgGeo::Vec2i& tileOrigin,
+				    const osgGeo::Vec2i& tileSize) const;
+    TransparencyType	getTransparencyType(int channel);
+			//! Whole image
+    TransparencyType	getTransparencyType(int channel,
+					    const osgGeo::Vec2i& origin,
+					    const osgGeo::Vec2i& size);
+			//! Image region, composed from block summaries
+    TransparencyType	getBlocksTransparencyType(int channel,
+					    const osgGeo::Vec2i& origin,
+					    const osgGeo::Vec2i& size);
+			//! Caller locks _transparencyMutex
+    void		clearBlockTransparencies(const osgGeo::Vec2i& origin,
+						 const osgGeo::Vec2i& size);
 
     const int					_id;
     osg::Vec2f					_origin;
@@ -340,7 +524,18 @@ struct LayeredTextureData : public osg::Referenced
     osg::Vec4f					_undefColorSource;
     int						_undefChannelRefCount[4];
     TransparencyType				_transparency[4];
-    std::vector<osg::Image*>			_tileImages;
+    std::vector<TransparencyType>		_blockTransparency[4];
+    OpenThreads::Mutex				_transparencyMutex;
+    std::vector<osg::ref_ptr<osg::Image> >	_tileImages;
+    const unsigned char*			_tileSourceData;
+    osgGeo::Vec2i				_dirtyOrigin;
+    osgGeo::Vec2i				_dirtySize;
+    bool					_subImageModified;
+    int						_contentVersion;
+
+    int						_packLayerId;
+    int						_packChannel;	// Texture channel
+    std::vector<int>				_packedIds;	// If pack layer
 };
 
 
@@ -377,8 +572,13 @@ LayeredTextureData* LayeredTextureData::clone() const
     {
 	res->_undefChannelRefCount[idx] = _undefChannelRefCount[idx];
 	res->_transparency[idx] = _transparency[idx];
+	res->_blockTransparency[idx] = _blockTransparency[idx];
     }
 
+    res->_packLayerId = _packLayerId;
+    res->_packChannel = _packChannel;
+    res->_packedIds = _packedIds;
+
     return res;
 }
 
@@ -395,8 +595,114 @@ osg::Vec2f LayeredTextureData::getLayerCoord( const osg::Vec2f& global ) const
 
 void LayeredTextureData::clearTransparencyType()
 {
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _transparencyMutex );
+    for ( int idx=0; idx<4; idx++ )
+    {
+	_transparency[idx] = TransparencyUnknown;
+	_blockTransparency[idx].clear();
+    }
+}
+
+
+// Side of the image blocks that keep their own transparency type
+static const int sTransparencyBlockSize = 64;
+
+TransparencyType LayeredTextureData::getTransparencyType( int channel )
+{
+    if ( !_image.get() )
+	return FullyTransparent;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _transparencyMutex );
+    TransparencyType& tt = _transparency[channel];
+
+    if ( tt==TransparencyUnknown )
+    {
+	tt = getBlocksTransparencyType( channel, osgGeo::Vec2i(0,0),
+				osgGeo::Vec2i(_image->s(),_image->t()) );
+    }
+
+    return tt;
+}
+
+
+TransparencyType LayeredTextureData::getTransparencyType( int channel, const osgGeo::Vec2i& origin, const osgGeo::Vec2i& size )
+{
+    // Tile specialization may run on cutout worker threads
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _transparencyMutex );
+    return getBlocksTransparencyType( channel, origin, size );
+}
+
+
+TransparencyType LayeredTextureData::getBlocksTransparencyType( int channel, const osgGeo::Vec2i& origin, const osgGeo::Vec2i& size )
+{
+    if ( !_image.get() || !_image->s() || !_image->t() )
+	return FullyTransparent;
+
+    const int nrBlocksS = (_image->s()-1) / sTransparencyBlockSize + 1;
+    const int nrBlocksT = (_image->t()-1) / sTransparencyBlockSize + 1;
+
+    std::vector<TransparencyType>& blocks = _blockTransparency[channel];
+    if ( blocks.empty() )
+	blocks.resize( nrBlocksS*nrBlocksT, TransparencyUnknown );
+
+    const int firstS = std::max( 0, origin.x()/sTransparencyBlockSize );
+    const int firstT = std::max( 0, origin.y()/sTransparencyBlockSize );
+    const int lastS = std::min( nrBlocksS-1, (origin.x()+size.x()-1)/sTransparencyBlockSize );
+    const int lastT = std::min( nrBlocksT-1, (origin.y()+size.y()-1)/sTransparencyBlockSize );
+
+    TransparencyType res = TransparencyUnknown;
+
+    for ( int bt=firstT; bt<=lastT; bt++ )
+    {
+	for ( int bs=firstS; bs<=lastS; bs++ )
+	{
+	    TransparencyType& tt = blocks[bt*nrBlocksS+bs];
+	    if ( tt==TransparencyUnknown )
+	    {
+		const int s0 = bs*sTransparencyBlockSize;
+		const int t0 = bt*sTransparencyBlockSize;
+		tt = getImageTransparencyType( _image, channel, s0, t0,
+			std::min(sTransparencyBlockSize, _image->s()-s0),
+			std::min(sTransparencyBlockSize, _image->t()-t0) );
+	    }
+
+	    res = res==TransparencyUnknown ? tt : mergeTransparencies(res,tt);
+	    if ( res==HasTransparencies )
+		return res;
+	}
+    }
+
+    return res==TransparencyUnknown ? FullyTransparent : res;
+}
+
+
+void LayeredTextureData::clearBlockTransparencies( const osgGeo::Vec2i& origin, const osgGeo::Vec2i& size )
+{
+    if ( !_image.get() )
+	return;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _transparencyMutex );
+
+    const int nrBlocksS = (_image->s()-1) / sTransparencyBlockSize + 1;
+    const int firstS = origin.x() / sTransparencyBlockSize;
+    const int firstT = origin.y() / sTransparencyBlockSize;
+    const int lastS = (origin.x()+size.x()-1) / sTransparencyBlockSize;
+    const int lastT = (origin.y()+size.y()-1) / sTransparencyBlockSize;
+
     for ( int idx=0; idx<4; idx++ )
+    {
+	std::vector<TransparencyType>& blocks = _blockTransparency[idx];
+	if ( blocks.empty() )
+	    continue;
+
 	_transparency[idx] = TransparencyUnknown;
+
+	for ( int bt=firstT; bt<=lastT; bt++ )
+	{
+	    for ( int bs=firstS; bs<=lastS; bs++ )
+		blocks[bt*nrBlocksS+bs] = TransparencyUnknown;
+	}
+    }
 }
 
 
@@ -495,125 +801,897 @@ osg::Vec4f LayeredTextureData::getTextureVec( const osg::Vec2f& globalCoord ) co
 }
 
 
-void LayeredTextureData::cleanUp()
+// Texel readers returning the same as osg::Image::getColor() does for
+// GL_UNSIGNED_BYTE data, but without its run-time format switch.
+
+static const float sUByteScale = 1.0f/255.0f;
+
+struct LuminanceUByteTexel
 {
-    std::vector<osg::Image*>::iterator it = _tileImages.begin();
-    for ( ; it!=_tileImages.end(); it++ )
-	(*it)->unref();
+    enum		{ nrBytes = 1 };
+    static void		read(const unsigned char* ptr,osg::Vec4f& col)
+			{
+			    const float l = float(ptr[0]) * sUByteScale;
+			    col.set( l, l, l, 1.0f );
+			}
+};
 
-    _tileImages.clear();
-}
+
+struct LuminanceAlphaUByteTexel
+{
+    enum		{ nrBytes = 2 };
+    static void		read(const unsigned char* ptr,osg::Vec4f& col)
+			{
+			    const float l = float(ptr[0]) * sUByteScale;
+			    col.set( l, l, l, float(ptr[1])*sUByteScale );
+			}
+};
 
 
-//============================================================================
+struct RGBUByteTexel
+{
+    enum		{ nrBytes = 3 };
+    static void		read(const unsigned char* ptr,osg::Vec4f& col)
+			{
+			    col.set( float(ptr[0])*sUByteScale,
+				     float(ptr[1])*sUByteScale,
+				     float(ptr[2])*sUByteScale, 1.0f );
+			}
+};
 
 
-struct TilingInfo
+struct RGBAUByteTexel
 {
-			TilingInfo()			{ reInit(); }
+    enum		{ nrBytes = 4 };
+    static void		read(const unsigned char* ptr,osg::Vec4f& col)
+			{
+			    col.set( float(ptr[0])*sUByteScale,
+				     float(ptr[1])*sUByteScale,
+				     float(ptr[2])*sUByteScale,
+				     float(ptr[3])*sUByteScale );
+			}
+};
 
-    void		reInit()
+
+/* Compile-time specialized counterpart of GET_COLOR and getTextureVec(),
+   with a plain memory walk for unit-step nearest sampling. */
+
+template <class Texel>
+class TexelSampler
+{
+public:
+			TexelSampler(const LayeredTextureData& ltd)
+			    : _image( *ltd._image )
+			    , _borderColor( ltd._borderColor )
+			    , _width( ltd._image->s() )
+			    , _height( ltd._image->t() )
+			{}
+
+    void		getColor(int s,int t,osg::Vec4f& col) const
 			{
-			    _envelopeOrigin = osg::Vec2f( 0.0f, 0.0f );
-			    _envelopeSize = osg::Vec2f( 0.0f, 0.0f );
-			    _smallestScale = osg::Vec2f( 1.0f, 1.0f );
-			    _maxTileSize = osg::Vec2f( 0.0f, 0.0f );
-			    _needsUpdate = false;
-			    _retilingNeeded = true;
+			    if ( s>=0 && s<_width && t>=0 && t<_height )
+				Texel::read( _image.data(s,t), col );
+			    else if ( _borderColor[0]>=0.0f )
+				col = _borderColor;
+			    else
+			    {
+				const int sClamp = s<=0 ? 0 :
+					( s>=_width ? _width-1 : s );
+				const int tClamp = t<=0 ? 0 :
+					( t>=_height ? _height-1 : t );
+				Texel::read( _image.data(sClamp,tClamp), col );
+			    }
 			}
 
-    osg::Vec2f		_envelopeOrigin;
-    osg::Vec2f		_envelopeSize;
-    osg::Vec2f		_smallestScale;
-    osg::Vec2f  	_maxTileSize;
-    bool		_needsUpdate;
-    bool		_retilingNeeded;
-};
+    void		sample(osg::Vec2f local,bool nearest,
+			       osg::Vec4f& res) const;
 
+    bool		walkRow(int s,int t,int nr,osg::Vec4f* res) const
+			{
+			    if ( s<0 || s+nr>_width || t<0 || t>=_height )
+				return false;
 
-//============================================================================
+			    const unsigned char* ptr = _image.data( s, t );
+			    for ( int idx=0; idx<nr; idx++ )
+			    {
+				Texel::read( ptr, res[idx] );
+				ptr += Texel::nrBytes;
+			    }
 
+			    return true;
+			}
 
-LayeredTexture::LayeredTexture()
-    : _freeId( 1 )
-    , _updateSetupStateSet( false )
-    , _maxTextureCopySize( 32*32 )
-    , _tilingInfo( new TilingInfo )
-    , _stackUndefLayerId( -1 )
-    , _stackUndefChannel( 0 )
-    , _stackUndefColor( 0.0f, 0.0f, 0.0f, 0.0f )
-    , _useShaders( true )
-    , _compositeLayerUpdate( true )
-    , _invertUndefLayers( false )
-{
-    _compositeLayerId = addDataLayer();
-}
+protected:
+    const osg::Image&	_image;
+    const osg::Vec4f&	_borderColor;
+    const int		_width;
+    const int		_height;
+};
 
 
-LayeredTexture::LayeredTexture( const LayeredTexture& lt,
-				const osg::CopyOp& co )
-    : osg::Object( lt, co )
-    , _freeId( lt._freeId )
-    , _updateSetupStateSet( false )
-    , _setupStateSet( 0 )
-    , _maxTextureCopySize( lt._maxTextureCopySize )
-    , _tilingInfo( new TilingInfo(*lt._tilingInfo) )
-    , _stackUndefLayerId( lt._stackUndefLayerId )
-    , _stackUndefChannel( lt._stackUndefChannel )
-    , _stackUndefColor( lt._stackUndefColor )
-    , _useShaders( lt._useShaders )
-    , _compositeLayerId( lt._compositeLayerId )
-    , _compositeLayerUpdate( lt._compositeLayerUpdate )
+template <class Texel>
+void TexelSampler<Texel>::sample( osg::Vec2f local, bool nearest, osg::Vec4f& res ) const
 {
-    for ( unsigned int idx=0; idx<lt._dataLayers.size(); idx++ )
+    if ( !nearest )
+	local -= osg::Vec2f( 0.5, 0.5 );
+
+    int s = (int) floor( local.x() );
+    int t = (int) floor( local.y() );
+
+    getColor( s, t, res );
+
+    if ( nearest )
+	return;
+
+    const float sFrac = local.x()-s;
+    const float tFrac = local.y()-t;
+
+    osg::Vec4f col01, col10, col11;
+
+    if ( !tFrac )
     {
-	osg::ref_ptr<LayeredTextureData> layer =
-		co.getCopyFlags()==osg::CopyOp::DEEP_COPY_ALL
-	    ? lt._dataLayers[idx]->clone()
-	    : lt._dataLayers[idx];
+	if ( !sFrac )
+	    return;
 
-	layer->ref();
-	_dataLayers.push_back( layer );
+	getColor( s+1, t, col10 );
+	res = res*(1.0f-sFrac) + col10*sFrac;
+	return;
     }
-}
 
+    getColor( s, t+1, col01 );
+    res = res*(1.0f-tFrac) + col01*tFrac;
 
-LayeredTexture::~LayeredTexture()
-{
-    std::for_each( _dataLayers.begin(), _dataLayers.end(),
-	    	   osg::intrusive_ptr_release );
+    if ( !sFrac )
+	return;
 
-    std::for_each( _processes.begin(), _processes.end(),
-	    	   osg::intrusive_ptr_release );
+    getColor( s+1, t+1, col11 );
+    getColor( s+1, t, col10 );
 
-    delete _tilingInfo;
+    col10 = col10*(1.0f-tFrac) + col11*tFrac;
+    res = res*(1.0f-sFrac) + col10*sFrac;
 }
 
 
-int LayeredTexture::addDataLayer()
+template <class Texel>
+static void sampleTextureVecSpan( const LayeredTextureData& ltd, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr, osg::Vec4f* res )
 {
-    _lock.writeLock();
-    osg::ref_ptr<LayeredTextureData> ltd = new LayeredTextureData( _freeId++ );
-    if ( ltd )
+    const TexelSampler<Texel> sampler( ltd );
+    const bool nearest = ltd._filterType==Nearest;
+    const osg::Vec2f localStart = ltd.getLayerCoord( globalStart );
+
+    if ( nearest )
     {
-	ltd->ref();
-	_dataLayers.push_back( ltd );
+	const osg::Vec2f localStep = ltd.getLayerCoord(globalStart+globalStep)
+				     - localStart;
+	if ( localStep.x()==1.0f && localStep.y()==0.0f )
+	{
+	    const int s = (int) floor( localStart.x() );
+	    const int t = (int) floor( localStart.y() );
+	    if ( sampler.walkRow(s,t,nr,res) )
+		return;
+	}
     }
 
-    _lock.writeUnlock();
-    return ltd ? ltd->_id : -1;
+    for ( int idx=0; idx<nr; idx++ )
+    {
+	const osg::Vec2f global = globalStart + globalStep*float(idx);
+	sampler.sample( ltd.getLayerCoord(global), nearest, res[idx] );
+    }
 }
 
 
-void LayeredTexture::raiseUndefChannelRefCount( bool yn, int idx )
+void LayeredTextureData::getTextureVecSpan( const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr, osg::Vec4f* res ) const
 {
-    int udfIdx = getDataLayerIndex( _stackUndefLayerId );
-    int channel = _stackUndefChannel;
-
-    if ( idx>=0 && idx<nrDataLayers() )
+    if ( !_image.get() || !_image->s() || !_image->t() )
     {
-	udfIdx = getDataLayerIndex( _dataLayers[idx]->_undefLayerId );
-	channel = _dataLayers[idx]->_undefChannel;
+	for ( int idx=0; idx<nr; idx++ )
+	    res[idx] = _borderColor;
+
+	return;
+    }
+
+    if ( _image->getDataType()==GL_UNSIGNED_BYTE )
+    {
+	switch ( _image->getPixelFormat() )
+	{
+	    case GL_LUMINANCE:
+		sampleTextureVecSpan<LuminanceUByteTexel>(
+				*this, globalStart, globalStep, nr, res );
+		return;
+	    case GL_LUMINANCE_ALPHA:
+		sampleTextureVecSpan<LuminanceAlphaUByteTexel>(
+				*this, globalStart, globalStep, nr, res );
+		return;
+	    case GL_RGB:
+		sampleTextureVecSpan<RGBUByteTexel>(
+				*this, globalStart, globalStep, nr, res );
+		return;
+	    case GL_RGBA:
+		sampleTextureVecSpan<RGBAUByteTexel>(
+				*this, globalStart, globalStep, nr, res );
+		return;
+	    default:
+		break;
+	}
+    }
+
+    for ( int idx=0; idx<nr; idx++ )
+	res[idx] = getTextureVec( globalStart + globalStep*float(idx) );
+}
+
+
+void LayeredTextureData::cleanUp()
+{
+    _tileImages.clear();
+    _tileSourceData = 0;
+}
+
+
+bool LayeredTextureData::hasDirtyRect() const
+{ return _dirtySize.x()>0 && _dirtySize.y()>0; }
+
+
+bool LayeredTextureData::isTileDirty( const osgGeo::Vec2i& tileOrigin, const osgGeo::Vec2i& tileSize ) const
+{
+    // Scaled image copies are always updated as a whole
+    if ( !hasDirtyRect() || _image.get()!=_imageSource.get() )
+	return true;
+
+    return tileOrigin.x() < _dirtyOrigin.x()+_dirtySize.x() &&
+	   tileOrigin.y() < _dirtyOrigin.y()+_dirtySize.y() &&
+	   tileOrigin.x()+tileSize.x() > _dirtyOrigin.x() &&
+	   tileOrigin.y()+tileSize.y() > _dirtyOrigin.y();
+}
+
+
+//============================================================================
+
+
+struct TilingInfo
+{
+			TilingInfo()			{ reInit(); }
+
+    void		reInit()
+			{
+			    _envelopeOrigin = osg::Vec2f( 0.0f, 0.0f );
+			    _envelopeSize = osg::Vec2f( 0.0f, 0.0f );
+			    _smallestScale = osg::Vec2f( 1.0f, 1.0f );
+			    _maxTileSize = osg::Vec2f( 0.0f, 0.0f );
+			    _needsUpdate = false;
+			    _needsRefit = false;
+			    _retilingNeeded = true;
+			}
+
+    osg::Vec2f		_envelopeOrigin;
+    osg::Vec2f		_envelopeSize;
+    osg::Vec2f		_smallestScale;
+    osg::Vec2f  	_maxTileSize;
+    bool		_needsUpdate;
+    bool		_needsRefit;	// Only layers moved or rescaled
+    bool		_retilingNeeded;
+};
+
+
+//============================================================================
+
+
+/* Process stack compiled once per stack change, so shader generation,
+   texture unit assignment and CPU compositing need not derive it again. */
+
+struct ProcessPlan
+{
+			ProcessPlan()			{ reInit(); }
+
+    void		reInit()
+			{
+			    _orderedLayerIDs.clear();
+			    _nrUsedLayers = 0;
+			    _nrProc = 0;
+			    _stackIsOpaque = false;
+			    _activeProcs.clear();
+			    _overflowProcs.clear();
+			    _activeUnits.clear();
+			    _needColSeqTexture = false;
+			    _minUnit = NR_TEXTURE_UNITS;
+			    _needsUpdate = true;
+			}
+
+    std::vector<int>		_orderedLayerIDs;
+    int				_nrUsedLayers;
+    int				_nrProc;
+    bool			_stackIsOpaque;
+    std::vector<LayerProcess*>	_activeProcs;	// In order of processing,
+						// up to first opaque one
+    std::vector<LayerProcess*>	_overflowProcs;	// Idem, the ones that do
+						// not fit in texture units
+    std::vector<int>		_activeUnits;	// Excluding ColSeqTexture
+    bool			_needColSeqTexture;
+    int				_minUnit;
+    bool			_needsUpdate;
+};
+
+
+//============================================================================
+
+
+struct TileTextureKey
+{
+    bool		operator<(const TileTextureKey&) const;
+
+    int				_layerId;
+    const osg::Image*		_image;
+    const unsigned char*	_data;
+    int				_version;	// -1 if tile views image
+    osgGeo::Vec2i		_origin;
+    osgGeo::Vec2i		_size;
+    int				_filterType;
+    bool			_nonPowerOf2;
+    int				_wrapS;
+    int				_wrapT;
+    osg::Vec4f			_borderColor;
+};
+
+
+#define COMPARE_KEY_MEMBER( member ) \
+    if ( member!=key.member ) \
+	return member<key.member;
+
+bool TileTextureKey::operator<( const TileTextureKey& key ) const
+{
+    COMPARE_KEY_MEMBER( _layerId );
+    COMPARE_KEY_MEMBER( _image );
+    COMPARE_KEY_MEMBER( _data );
+    COMPARE_KEY_MEMBER( _version );
+    COMPARE_KEY_MEMBER( _origin );
+    COMPARE_KEY_MEMBER( _size );
+    COMPARE_KEY_MEMBER( _filterType );
+    COMPARE_KEY_MEMBER( _nonPowerOf2 );
+    COMPARE_KEY_MEMBER( _wrapS );
+    COMPARE_KEY_MEMBER( _wrapT );
+    return _borderColor<key._borderColor;
+}
+
+
+/* Tile textures are only dropped if no stateset uses them anymore, so the
+   cache can temporarily exceed its maximum size. */
+
+struct TileTextureCache
+{
+			TileTextureCache()
+			    : _maxNrBytes( 256*1024*1024 )
+			    , _nrBytes( 0 )
+			{}
+
+    osg::ref_ptr<osg::Texture2D> get(const TileTextureKey&);
+    osg::ref_ptr<osg::Texture2D> add(const TileTextureKey&,osg::Texture2D*,
+				     unsigned int nrBytes);
+			//!Returns earlier texture if another thread was first
+    void		purge(const TileTextureKey& current);
+			//!Drops unused tiles of outdated images of a layer
+    void		dirtyViews(const LayeredTextureData&);
+			/*!Dirties all tiles viewing the dirty region of the
+			   layer image, including those of earlier tilings
+			   and of other nodes sharing the texture. */
+    void		shrink();
+
+    struct Entry
+    {
+	osg::ref_ptr<osg::Texture2D>		_texture;
+	unsigned int				_nrBytes;
+	std::list<TileTextureKey>::iterator	_lruPos;
+    };
+
+    typedef std::map<TileTextureKey,Entry>	EntryMap;
+
+    EntryMap			_entries;
+    std::list<TileTextureKey>	_lru;		// Most recently used first
+    unsigned int		_maxNrBytes;
+    unsigned int		_nrBytes;
+    OpenThreads::Mutex		_mutex;
+};
+
+
+osg::ref_ptr<osg::Texture2D> TileTextureCache::get( const TileTextureKey& key )
+{
+    EntryMap::iterator it = _entries.find( key );
+    if ( it==_entries.end() )
+	return 0;
+
+    _lru.splice( _lru.begin(), _lru, it->second._lruPos );
+    return it->second._texture;
+}
+
+
+osg::ref_ptr<osg::Texture2D> TileTextureCache::add( const TileTextureKey& key, osg::Texture2D* texture, unsigned int nrBytes )
+{
+    osg::ref_ptr<osg::Texture2D> earlier = get( key );
+    if ( earlier.valid() )
+	return earlier;
+
+    Entry& entry = _entries[key];
+    entry._texture = texture;
+    entry._nrBytes = nrBytes;
+    entry._lruPos = _lru.insert( _lru.begin(), key );
+    _nrBytes += nrBytes;
+
+    shrink();
+    return texture;
+}
+
+
+void TileTextureCache::purge( const TileTextureKey& current )
+{
+    EntryMap::iterator it = _entries.begin();
+    while ( it!=_entries.end() )
+    {
+	const TileTextureKey& key = it->first;
+	const bool outdated = key._layerId==current._layerId &&
+			      ( key._image!=current._image ||
+				key._data!=current._data ||
+				key._version!=current._version );
+
+	if ( outdated && it->second._texture->referenceCount()==1 )
+	{
+	    _nrBytes -= it->second._nrBytes;
+	    _lru.erase( it->second._lruPos );
+	    _entries.erase( it++ );
+	}
+	else
+	    it++;
+    }
+}
+
+
+void TileTextureCache::dirtyViews( const LayeredTextureData& layer )
+{
+    const osg::Image* image = layer._image.get();
+    if ( !image )
+	return;
+
+    EntryMap::iterator it = _entries.begin();
+    for ( ; it!=_entries.end(); it++ )
+    {
+	const TileTextureKey& key = it->first;
+	if ( key._layerId!=layer._id || key._version!=-1 ||
+	     key._image!=image || key._data!=image->data() ||
+	     !layer.isTileDirty(key._origin,key._size) )
+	    continue;
+
+	osg::Image* tileImage = it->second._texture->getImage();
+	if ( tileImage )
+	    tileImage->dirty();
+    }
+}
+
+
+void TileTextureCache::shrink()
+{
+    std::list<TileTextureKey>::iterator it = _lru.end();
+    while ( _nrBytes>_maxNrBytes && it!=_lru.begin() )
+    {
+	it--;
+	EntryMap::iterator eit = _entries.find( *it );
+	if ( eit->second._texture->referenceCount()>1 )
+	    continue;
+
+	_nrBytes -= eit->second._nrBytes;
+	_entries.erase( eit );
+	it = _lru.erase( it );
+    }
+}
+
+
+//============================================================================
+
+
+/* Part of a data layer cut out into the texture of one tile. The tile
+   geometry keeps the texture coordinates it was created with, so later
+   origin and scale changes of the layer are mapped onto those. */
+
+struct TileLayerCutout
+{
+			TileLayerCutout()
+			    : _layerId( -1 )
+			    , _wrapS( osg::Texture::CLAMP_TO_EDGE )
+			    , _wrapT( osg::Texture::CLAMP_TO_EDGE )
+			{}
+
+    int					_layerId;
+    osg::Vec2f				_localOrigin;	// Tile in layer pixels
+    osg::Vec2f				_localOpposite;
+    osgGeo::Vec2i			_usedOrigin;	// Pixels sampled
+    osgGeo::Vec2i			_usedSize;
+    osgGeo::Vec2i			_tileOrigin;	// Pixels in texture
+    osgGeo::Vec2i			_tileSize;
+    osg::Vec2f				_tc00;
+    osg::Vec2f				_tc11;
+    osg::Texture::WrapMode		_wrapS;
+    osg::Texture::WrapMode		_wrapT;
+    osg::Vec2f				_geometryTc00;
+    osg::Vec2f				_geometryTc11;
+    osg::ref_ptr<osg::Texture2D>	_texture;
+};
+
+
+static void setCutoutTexCoords( const LayeredTextureData& layer, TileLayerCutout& cutout )
+{
+    const osg::Vec2f tileOrigin( cutout._tileOrigin.x(), cutout._tileOrigin.y() );
+    osg::Vec2f& tc00 = cutout._tc00;
+    osg::Vec2f& tc11 = cutout._tc11;
+
+    tc00.x() = (cutout._localOrigin.x()-tileOrigin.x()) / cutout._tileSize.x();
+    tc00.y() = (cutout._localOrigin.y()-tileOrigin.y()) / cutout._tileSize.y();
+    tc11.x() = (cutout._localOpposite.x()-tileOrigin.x()) / cutout._tileSize.x();
+    tc11.y() = (cutout._localOpposite.y()-tileOrigin.y()) / cutout._tileSize.y();
+
+    cutout._wrapS = osg::Texture::CLAMP_TO_EDGE;
+    if ( layer._borderColor[0]>=0.0f && (tc00.x()<0.0f || tc11.x()>1.0f) )
+	cutout._wrapS = osg::Texture::CLAMP_TO_BORDER;
+
+    cutout._wrapT = osg::Texture::CLAMP_TO_EDGE;
+    if ( layer._borderColor[0]>=0.0f && (tc00.y()<0.0f || tc11.y()>1.0f) )
+	cutout._wrapT = osg::Texture::CLAMP_TO_BORDER;
+}
+
+
+/* Retargets a needed cutout onto the texture of an existing one, if that
+   still holds all pixels sampled and wraps at its borders alike. */
+
+static bool reuseCutoutTexture( const LayeredTextureData& layer, const TileLayerCutout& existing, TileLayerCutout& needed )
+{
+    const osgGeo::Vec2i& org = existing._tileOrigin;
+    const osgGeo::Vec2i end = existing._tileOrigin + existing._tileSize;
+    const osgGeo::Vec2i usedEnd = needed._usedOrigin + needed._usedSize;
+
+    if ( !existing._texture || needed._usedOrigin.x()<org.x() ||
+	 needed._usedOrigin.y()<org.y() || usedEnd.x()>end.x() ||
+	 usedEnd.y()>end.y() )
+	return false;
+
+    TileLayerCutout reused = needed;
+    reused._tileOrigin = existing._tileOrigin;
+    reused._tileSize = existing._tileSize;
+    setCutoutTexCoords( layer, reused );
+
+    if ( reused._wrapS!=existing._wrapS || reused._wrapT!=existing._wrapT )
+	return false;
+
+    reused._texture = existing._texture;
+    needed = reused;
+    return true;
+}
+
+
+static void setTileTextureMatrix( osg::StateSet& stateset, int unit, const TileLayerCutout& cutout )
+{
+    const osg::Vec2f geomSize = cutout._geometryTc11 - cutout._geometryTc00;
+    const osg::Vec2f size = cutout._tc11 - cutout._tc00;
+
+    osg::Vec2f scale( 1.0f, 1.0f );
+    if ( geomSize.x() != 0.0f )
+	scale.x() = size.x() / geomSize.x();
+    if ( geomSize.y() != 0.0f )
+	scale.y() = size.y() / geomSize.y();
+
+    const osg::Vec2f trans( cutout._tc00.x() - scale.x()*cutout._geometryTc00.x(),
+			    cutout._tc00.y() - scale.y()*cutout._geometryTc00.y() );
+
+    if ( scale.x()==1.0f && scale.y()==1.0f &&
+	 trans.x()==0.0f && trans.y()==0.0f )
+    {
+	stateset.removeTextureAttribute( unit, osg::StateAttribute::TEXMAT );
+	return;
+    }
+
+    const osg::Matrix mat = osg::Matrix::scale( scale.x(), scale.y(), 1.0 ) *
+			    osg::Matrix::translate( trans.x(), trans.y(), 0.0 );
+    stateset.setTextureAttribute( unit, new osg::TexMat(mat) );
+}
+
+
+//============================================================================
+
+
+struct TileStateSetInfo
+{
+    osg::ref_ptr<osg::StateSet>				_stateset;
+    osg::Vec2f						_globalOrigin;
+    osg::Vec2f						_globalOpposite;
+    std::map<int,TileLayerCutout>			_cutouts; // Per unit
+};
+
+
+/* Tiles handed out by createCutoutStateSet(), kept to specialize their
+   program and texture bindings again after process stack changes. */
+
+struct TileStateSetRegistry
+{
+    void		purge();
+			//!Drops tiles no longer used outside the registry
+
+    std::vector<TileStateSetInfo>	_tiles;
+    OpenThreads::Mutex			_mutex;
+};
+
+
+void TileStateSetRegistry::purge()
+{
+    std::vector<TileStateSetInfo>::iterator it = _tiles.begin();
+    while ( it!=_tiles.end() )
+    {
+	if ( it->_stateset->referenceCount()==1 )
+	    it = _tiles.erase( it );
+	else
+	    it++;
+    }
+}
+
+
+static TransparencyType getLayerRegionTransparencyType( LayeredTextureData& layer, int channel, const osg::Vec2f& globalOrigin, const osg::Vec2f& globalOpposite )
+{
+    const osg::Image* image = layer._image;
+    const osg::Vec2f localOrigin = layer.getLayerCoord( globalOrigin );
+    const osg::Vec2f localOpposite = layer.getLayerCoord( globalOpposite );
+
+    // Pixels contributing by linear filtering
+    int s0 = (int) floor( localOrigin.x()-0.5 );
+    int t0 = (int) floor( localOrigin.y()-0.5 );
+    int s1 = (int) ceil( localOpposite.x()+0.5 );
+    int t1 = (int) ceil( localOpposite.y()+0.5 );
+
+    const bool bordered = s0<0 || t0<0 || s1>image->s() || t1>image->t();
+    const bool edgeExtended = layer._borderColor[0]<0.0f;
+
+    if ( edgeExtended )
+    {
+	// Regions outside the image only show its nearest edge pixels
+	s0 = std::min( std::max(s0,0), image->s()-1 );
+	t0 = std::min( std::max(t0,0), image->t()-1 );
+	s1 = std::max( std::min(s1,image->s()), s0+1 );
+	t1 = std::max( std::min(t1,image->t()), t0+1 );
+    }
+    else
+    {
+	s0 = std::max( s0, 0 );
+	t0 = std::max( t0, 0 );
+	s1 = std::min( s1, image->s() );
+	t1 = std::min( t1, image->t() );
+
+	if ( s0>=s1 || t0>=t1 )
+	{
+	    const float opacity = layer._borderColor[channel];
+	    return opacity<=0.0f ? FullyTransparent :
+		   opacity>=1.0f ? Opaque : HasTransparencies;
+	}
+    }
+
+    const TransparencyType tt = layer.getTransparencyType( channel,
+			osgGeo::Vec2i(s0,t0), osgGeo::Vec2i(s1-s0,t1-t0) );
+
+    return bordered && !edgeExtended ?
+			addOpacity( tt, layer._borderColor[channel] ) : tt;
+}
+
+
+static void getProcessLayerIDs( const LayeredTexture& laytex, const LayerProcess& process, std::vector<int>& ids )
+{
+    for ( int idx=0; ; idx++ )
+    {
+	const int id = process.getDataLayerID( idx );
+	if ( id<0 )
+	{
+	    if ( idx>=4 )
+		break;
+
+	    continue;
+	}
+
+	ids.push_back( id );
+	ids.push_back( laytex.getDataLayerUndefLayerID(id) );
+    }
+}
+
+
+//============================================================================
+
+
+static bool canBePacked( const LayeredTextureData& layer )
+{
+    const osg::Image* image = layer._image;
+    if ( !image || image->r()!=1 || image->getDataType()!=GL_UNSIGNED_BYTE ||
+	 !layer._packedIds.empty() )
+	return false;
+
+    const GLenum format = image->getPixelFormat();
+    return format==GL_LUMINANCE || format==GL_ALPHA || format==GL_INTENSITY ||
+	   format==GL_RED || format==GL_GREEN || format==GL_BLUE;
+}
+
+
+// Border value of the only image channel, as seen in its texture channels
+static float getPackedBorderValue( const LayeredTextureData& layer )
+{
+    const GLenum format = layer._image->getPixelFormat();
+    for ( int tc=0; tc<4; tc++ )
+    {
+	if ( texture2ImageChannel(tc,format)==0 )
+	    return layer._borderColor[tc];
+    }
+
+    return -1.0f;
+}
+
+
+static bool canBePackedTogether( const LayeredTextureData& layer1, const LayeredTextureData& layer2 )
+{
+    if ( !canBePacked(layer1) || !canBePacked(layer2) )
+	return false;
+
+    // One wrap mode for all channels
+    const bool bordered1 = getPackedBorderValue(layer1)>=0.0f;
+    const bool bordered2 = getPackedBorderValue(layer2)>=0.0f;
+
+    return layer1._image->s()==layer2._image->s() &&
+	   layer1._image->t()==layer2._image->t() &&
+	   layer1._origin==layer2._origin &&
+	   layer1._scale==layer2._scale &&
+	   layer1._imageScale==layer2._imageScale &&
+	   layer1._filterType==layer2._filterType &&
+	   bordered1==bordered2;
+}
+
+
+static void copyPackedChannel( const osg::Image& srcImage, osg::Image& packImage, int packIdx, const osgGeo::Vec2i& origin, const osgGeo::Vec2i& size )
+{
+    const int step = packImage.getPixelSizeInBits()/8;
+    for ( int t=origin.y(); t<origin.y()+size.y(); t++ )
+    {
+	const unsigned char* srcPtr = srcImage.data( origin.x(), t );
+	unsigned char* packPtr = packImage.data( origin.x(), t ) + packIdx;
+	for ( int s=size.x(); s>0; s--, packPtr+=step )
+	    *packPtr = *srcPtr++;
+    }
+}
+
+
+//============================================================================
+
+
+static TileTextureKey getTileTextureKey( const LayeredTextureData& layer, const osgGeo::Vec2i& tileOrigin, const osgGeo::Vec2i& tileSize, bool useImageStride, bool nonPowerOf2 )
+{
+    TileTextureKey key;
+    key._layerId = layer._id;
+    key._image = layer._image.get();
+    key._data = layer._image.get() ? layer._image->data() : 0;
+    key._version = useImageStride ? -1 : layer._contentVersion;
+    key._origin = tileOrigin;
+    key._size = tileSize;
+    key._filterType = layer._filterType;
+    key._nonPowerOf2 = nonPowerOf2;
+    key._wrapS = key._wrapT = 0;
+    key._borderColor = layer._borderColor;
+    return key;
+}
+
+
+//============================================================================
+
+
+LayeredTexture::LayeredTexture()
+    : _freeId( 1 )
+    , _updateSetupStateSet( false )
+    , _lastFrameUpdate( -1 )
+    , _hasFrameUpdates( false )
+    , _maxTextureCopySize( 32*32 )
+    , _tilingInfo( new TilingInfo )
+    , _processPlan( new ProcessPlan )
+    , _tileTextureCache( new TileTextureCache )
+    , _tileStateSets( new TileStateSetRegistry )
+    , _stackUndefLayerId( -1 )
+    , _stackUndefChannel( 0 )
+    , _stackUndefColor( 0.0f, 0.0f, 0.0f, 0.0f )
+    , _useShaders( true )
+#ifdef USE_IMAGE_STRIDE
+    , _useImageStride( true )
+#else
+    , _useImageStride( false )
+#endif
+    , _useNonPowerOf2Textures( false )
+    , _compositeLayerUpdate( true )
+    , _compositeDirtyAll( true )
+    , _compositeDirtyMin( 1.0f, 1.0f )
+    , _compositeDirtyMax( -1.0f, -1.0f )
+    , _overflowLayerId( -1 )
+    , _overflowDirtyAll( true )
+    , _overflowDirtyMin( 1.0f, 1.0f )
+    , _overflowDirtyMax( -1.0f, -1.0f )
+    , _invertUndefLayers( false )
+{
+    _compositeLayerId = addDataLayer();
+}
+
+
+LayeredTexture::LayeredTexture( const LayeredTexture& lt,
+				const osg::CopyOp& co )
+    : osg::Object( lt, co )
+    , _freeId( lt._freeId )
+    , _updateSetupStateSet( false )
+    , _setupStateSet( 0 )
+    , _lastFrameUpdate( -1 )
+    , _hasFrameUpdates( false )
+    , _maxTextureCopySize( lt._maxTextureCopySize )
+    , _tilingInfo( new TilingInfo(*lt._tilingInfo) )
+    , _processPlan( new ProcessPlan )
+    , _tileTextureCache( new TileTextureCache )
+    , _tileStateSets( new TileStateSetRegistry )
+    , _stackUndefLayerId( lt._stackUndefLayerId )
+    , _stackUndefChannel( lt._stackUndefChannel )
+    , _stackUndefColor( lt._stackUndefColor )
+    , _useShaders( lt._useShaders )
+    , _useImageStride( lt._useImageStride )
+    , _useNonPowerOf2Textures( lt._useNonPowerOf2Textures )
+    , _compositeLayerId( lt._compositeLayerId )
+    , _compositeLayerUpdate( lt._compositeLayerUpdate )
+    , _compositeDirtyAll( true )
+    , _compositeDirtyMin( 1.0f, 1.0f )
+    , _compositeDirtyMax( -1.0f, -1.0f )
+    , _overflowLayerId( lt._overflowLayerId )
+    , _overflowDirtyAll( true )
+    , _overflowDirtyMin( 1.0f, 1.0f )
+    , _overflowDirtyMax( -1.0f, -1.0f )
+{
+    for ( unsigned int idx=0; idx<lt._dataLayers.size(); idx++ )
+    {
+	osg::ref_ptr<LayeredTextureData> layer =
+		co.getCopyFlags()==osg::CopyOp::DEEP_COPY_ALL
+	    ? lt._dataLayers[idx]->clone()
+	    : lt._dataLayers[idx];
+
+	layer->ref();
+	_dataLayers.push_back( layer );
+    }
+}
+
+
+LayeredTexture::~LayeredTexture()
+{
+    std::for_each( _dataLayers.begin(), _dataLayers.end(),
+	    	   osg::intrusive_ptr_release );
+
+    std::for_each( _processes.begin(), _processes.end(),
+	    	   osg::intrusive_ptr_release );
+
+    delete _tilingInfo;
+    delete _processPlan;
+    delete _tileTextureCache;
+    delete _tileStateSets;
+}
+
+
+int LayeredTexture::addDataLayer()
+{
+    _lock.writeLock();
+    osg::ref_ptr<LayeredTextureData> ltd = new LayeredTextureData( _freeId++ );
+    if ( ltd )
+    {
+	ltd->ref();
+	_dataLayers.push_back( ltd );
+    }
+
+    _lock.writeUnlock();
+    return ltd ? ltd->_id : -1;
+}
+
+
+void LayeredTexture::raiseUndefChannelRefCount( bool yn, int idx )
+{
+    int udfIdx = getDataLayerIndex( _stackUndefLayerId );
+    int channel = _stackUndefChannel;
+
+    if ( idx>=0 && idx<nrDataLayers() )
+    {
+	udfIdx = getDataLayerIndex( _dataLayers[idx]->_undefLayerId );
+	channel = _dataLayers[idx]->_undefChannel;
     }
 
     if ( udfIdx!=-1 )
@@ -669,14 +1747,24 @@ int LayeredTexture::getDataLayerID( int idx ) const
 
 int LayeredTexture::getDataLayerIndex( int id ) const
 {
-    int size = _dataLayers.size();
-    if ( id<size )	
-	size = id;	// Optimization since layers are ID-sorted
+    // Binary search, since layers are ID-sorted
+    int first = 0;
+    int last = _dataLayers.size()-1;
+    if ( id<=last )
+	last = id-1;
 
-    for ( int idx=size-1; idx>=0; idx-- )
+    while ( first<=last )
     {
-	if ( _dataLayers[idx]->_id==id )
-	    return idx;
+	const int mid = (first+last) / 2;
+	const int midId = _dataLayers[mid]->_id;
+
+	if ( midId==id )
+	    return mid;
+
+	if ( midId<id )
+	    first = mid+1;
+	else
+	    last = mid-1;
     }
 
     return -1;
@@ -686,10 +1774,10 @@ int LayeredTexture::getDataLayerIndex( int id ) const
 void LayeredTexture::setDataLayerOrigin( int id, const osg::Vec2f& origin )
 {
     const int idx = getDataLayerIndex( id );
-    if ( idx!=-1 )
+    if ( idx!=-1 && _dataLayers[idx]->_origin!=origin )
     {
 	_dataLayers[idx]->_origin = origin; 
-	_tilingInfo->_needsUpdate = true;
+	moveDataLayer( *_dataLayers[idx] );
     }
 }
 
@@ -697,11 +1785,26 @@ void LayeredTexture::setDataLayerOrigin( int id, const osg::Vec2f& origin )
 void LayeredTexture::setDataLayerScale( int id, const osg::Vec2f& scale )
 {
     const int idx = getDataLayerIndex( id );
-    if ( idx!=-1 && scale.x()>=0.0f && scale.y()>0.0f )
+    if ( idx!=-1 && scale.x()>=0.0f && scale.y()>0.0f &&
+	 _dataLayers[idx]->_scale!=scale )
     {
 	_dataLayers[idx]->_scale = scale; 
+	moveDataLayer( *_dataLayers[idx] );
+    }
+}
+
+
+void LayeredTexture::moveDataLayer( const LayeredTextureData& layer )
+{
+    // Packed layers have to be regrouped on new tiles
+    if ( layer._packLayerId>=0 || !layer._packedIds.empty() )
+    {
 	_tilingInfo->_needsUpdate = true;
+	return;
     }
+
+    _tilingInfo->_needsRefit = true;
+    _updateSetupStateSet = true;
 }
 
 
@@ -723,19 +1826,22 @@ void LayeredTexture::setDataLayerImage( int id, const osg::Image* image )
 
 	osgGeo::Vec2i newImageSize( image->s(), image->t() );
 
-#ifdef USE_IMAGE_STRIDE
-	const bool retile = layer._imageSource.get()!=image || layer._imageSourceSize!=newImageSize || !layer._tileImages.size();
-#else
-	const bool retile = true;
-#endif
-
 	const int s = getTextureSize( image->s() );
 	const int t = getTextureSize( image->t() );
 
 	bool scaleImage = s>image->s() || t>image->t();
 	scaleImage = scaleImage && s*t<=(int) _maxTextureCopySize;
+	scaleImage = scaleImage && !_useNonPowerOf2Textures;
+	scaleImage = scaleImage && id!=_compositeLayerId;
+	scaleImage = scaleImage && id!=_overflowLayerId;
+
+	const bool wasScaled = layer._image.get() &&
+			       layer._image.get()!=layer._imageSource.get();
 
-	if ( scaleImage && id!=_compositeLayerId )
+	// Tiles viewing a source image that was reallocated must go
+	const bool retile = !_useImageStride || layer._imageSource.get()!=image || layer._imageSourceSize!=newImageSize || !layer._tileImages.size() || wasScaled!=scaleImage || (!wasScaled && layer._tileSourceData!=image->data());
+
+	if ( scaleImage )
 	{
 	    osg::Image* imageCopy = new osg::Image( *image );
 	    imageCopy->scaleImage( s, t, image->r() );
@@ -755,6 +1861,7 @@ void LayeredTexture::setDataLayerImage( int id, const osg::Image* image )
 
 	layer._imageSource = image;
 	layer._imageSourceSize = newImageSize;
+	layer._contentVersion++;
 	layer._imageModifiedCount = image->getModifiedCount();
 	layer.clearTransparencyType();
 
@@ -768,10 +1875,18 @@ void LayeredTexture::setDataLayerImage( int id, const osg::Image* image )
 	}
 	else
 	{
-	    std::vector<osg::Image*>::iterator it = layer._tileImages.begin();
-	    for ( ; it!=layer._tileImages.end(); it++ )
-		(*it)->dirty();
+	    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileTextureCache->_mutex );
+	    _tileTextureCache->dirtyViews( layer );
 	}
+
+	if ( layer._packLayerId>=0 )
+	    refreshPackedChannel( layer );
+
+	layer._dirtySize = osgGeo::Vec2i( 0, 0 );
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileTextureCache->_mutex );
+	_tileTextureCache->purge( getTileTextureKey(layer,osgGeo::Vec2i(),
+		    osgGeo::Vec2i(),_useImageStride,_useNonPowerOf2Textures) );
     }
     else
     {
@@ -783,6 +1898,99 @@ void LayeredTexture::setDataLayerImage( int id, const osg::Image* image )
 }
 
 
+void LayeredTexture::touchDataLayerImage( int id, int s, int t, int width, int height )
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx==-1 || width<1 || height<1 )
+	return;
+
+    LayeredTextureData& layer = *_dataLayers[idx];
+    if ( !layer.hasDirtyRect() )
+    {
+	layer._dirtyOrigin = osgGeo::Vec2i( s, t );
+	layer._dirtySize = osgGeo::Vec2i( width, height );
+	return;
+    }
+
+    const int minS = std::min( s, layer._dirtyOrigin.x() );
+    const int minT = std::min( t, layer._dirtyOrigin.y() );
+    const int maxS = std::max( s+width, layer._dirtyOrigin.x()+layer._dirtySize.x() );
+    const int maxT = std::max( t+height, layer._dirtyOrigin.y()+layer._dirtySize.y() );
+
+    layer._dirtyOrigin = osgGeo::Vec2i( minS, minT );
+    layer._dirtySize = osgGeo::Vec2i( maxS-minS, maxT-minT );
+}
+
+
+void LayeredTexture::setDataLayerSubImage( int id, int s, int t, const osg::Image* subImage )
+{
+    if ( id==_compositeLayerId || !subImage )
+	return;
+
+    _lock.writeLock();
+
+    const int idx = getDataLayerIndex( id );
+    if ( idx==-1 )
+    {
+	_lock.writeUnlock();
+	return;
+    }
+
+    LayeredTextureData& layer = *_dataLayers[idx];
+    osg::Image* image = const_cast<osg::Image*>( layer._imageSource.get() );
+
+    if ( !image || subImage->getPixelFormat()!=image->getPixelFormat() ||
+	 subImage->getDataType()!=image->getDataType() )
+    {
+	std::cerr << "Sub-image does not match data layer image" << std::endl;
+	_lock.writeUnlock();
+	return;
+    }
+
+    if ( s<0 || t<0 || s+subImage->s()>image->s() || t+subImage->t()>image->t() )
+    {
+	std::cerr << "Sub-image exceeds data layer image" << std::endl;
+	_lock.writeUnlock();
+	return;
+    }
+
+    const int rowSize = subImage->s() * image->getPixelSizeInBits()/8;
+    for ( int row=0; row<subImage->t(); row++ )
+	memcpy( image->data(s,t+row), subImage->data(0,row), rowSize );
+
+    touchDataLayerImage( id, s, t, subImage->s(), subImage->t() );
+
+    // Tiles are copies if no image stride is used
+    const bool incremental = _useImageStride && image->r()==1 &&
+			     layer._image.get()==image &&
+			     layer._tileSourceData==image->data() &&
+			     layer._packLayerId<0;
+
+    if ( !incremental )
+    {
+	// Scaled copy needs refresh by checkForModifiedImages()
+	image->dirty();
+	_lock.writeUnlock();
+	return;
+    }
+
+    // Only the blocks touched will be reclassified
+    layer.clearBlockTransparencies( osgGeo::Vec2i(s,t),
+			osgGeo::Vec2i(subImage->s(),subImage->t()) );
+
+    {
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileTextureCache->_mutex );
+	_tileTextureCache->dirtyViews( layer );
+    }
+
+    expandCompositeDirtyRegion( layer );
+    layer._dirtySize = osgGeo::Vec2i( 0, 0 );
+    layer._subImageModified = true;
+
+    _lock.writeUnlock();
+}
+
+
 void LayeredTexture::setDataLayerUndefLayerID( int id, int undefId )
 {
     const int idx = getDataLayerIndex( id );
@@ -937,18 +2145,21 @@ GET_PROP( BorderColor, const osg::Vec4f&, _borderColor, osg::Vec4f(1.0f,1.0f,1.0
 GET_PROP( ImageUndefColor, const osg::Vec4f&, _undefColor, osg::Vec4f(-1.0f,-1.0f,-1.0f,-1.0f) )
 
 
-TransparencyType LayeredTexture::getDataLayerTransparencyType( int id, int channel ) const
+TransparencyType LayeredTexture::getDataLayerTransparencyType( int id, int channel, const osg::Vec2f* globalOrigin, const osg::Vec2f* globalOpposite ) const
 {
     const int idx = getDataLayerIndex( id );
     if ( idx==-1 || channel<0 || channel>3 || !_dataLayers[idx]->_image )
 	return FullyTransparent;
 
-    TransparencyType& tt = _dataLayers[idx]->_transparency[channel];
-
-    if ( tt==TransparencyUnknown )
-	tt = getImageTransparencyType( _dataLayers[idx]->_image, channel );
+    LayeredTextureData& layer = *_dataLayers[idx];
+    if ( globalOrigin && globalOpposite )
+    {
+	return getLayerRegionTransparencyType( layer, channel, *globalOrigin,
+					       *globalOpposite );
+    }
 
-    return addOpacity( tt, _dataLayers[idx]->_borderColor[channel] );
+    const TransparencyType tt = layer.getTransparencyType( channel );
+    return addOpacity( tt, layer._borderColor[channel] );
 }
 
 
@@ -962,6 +2173,68 @@ osg::Vec4f LayeredTexture::getDataLayerTextureVec( int id, const osg::Vec2f& glo
 }
 
 
+void LayeredTexture::getDataLayerTextureVecSpan( int id, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr, osg::Vec4f* res ) const
+{
+    const int idx = getDataLayerIndex( id );
+    if ( idx==-1 )
+    {
+	for ( int sample=0; sample<nr; sample++ )
+	    res[sample] = osg::Vec4f( -1.0f, -1.0f, -1.0f, -1.0f );
+
+	return;
+    }
+
+    _dataLayers[idx]->getTextureVecSpan( globalStart, globalStep, nr, res );
+}
+
+
+void LayeredTexture::getDataLayerSampleCode( std::string& expr, int id, int channel ) const
+{
+    char sample[50];
+    sprintf( sample, "texture2D( texture%d, texcrd )", getDataLayerTextureUnit(id) );
+    expr = sample;
+
+    const int idx = getDataLayerIndex( id );
+    const LayeredTextureData* layer = idx!=-1 ? _dataLayers[idx] : 0;
+
+    if ( !layer || layer->_packLayerId<0 || !layer->_image )
+    {
+	if ( channel>=0 )
+	{
+	    sprintf( sample, "[%d]", channel );
+	    expr += sample;
+	}
+	return;
+    }
+
+    // Rebuild the texture vector of the single-channel image
+    std::string texVec[4];
+    const GLenum format = layer->_image->getPixelFormat();
+    for ( int tc=0; tc<4; tc++ )
+    {
+	const int ic = texture2ImageChannel( tc, format );
+	if ( ic==ZERO_CHANNEL )
+	    texVec[tc] = "0.0";
+	else if ( ic==ONE_CHANNEL )
+	    texVec[tc] = "1.0";
+	else
+	{
+	    sprintf( sample, "[%d]", layer->_packChannel );
+	    texVec[tc] = expr + sample;
+	}
+    }
+
+    if ( channel>=0 )
+	expr = texVec[channel<4 ? channel : 3];
+    else if ( texVec[0]!=texVec[1] || texVec[1]!=texVec[2] )
+	expr = "vec4( " + texVec[0] + ", " + texVec[1] + ", " + texVec[2] + ", " + texVec[3] + " )";
+    else if ( texVec[0]!=texVec[3] )
+	expr = "vec4( vec3(" + texVec[0] + "), " + texVec[3] + " )";
+    else
+	expr = "vec4( " + texVec[0] + " )";
+}
+
+
 LayerProcess* LayeredTexture::getProcess( int idx )
 { return idx>=0 && idx<(int) _processes.size() ? _processes[idx] : 0;  }
 
@@ -1022,9 +2295,10 @@ MOVE_LAYER( moveProcessLater, neighbor!=_processes.end(), +1 )
 
 void LayeredTexture::updateTilingInfoIfNeeded() const
 {
-    if ( !_tilingInfo->_needsUpdate )
+    if ( !_tilingInfo->_needsUpdate && !_tilingInfo->_needsRefit )
 	return;
 
+    const TilingInfo oldInfo = *_tilingInfo;
     _tilingInfo->reInit();
 
     std::vector<LayeredTextureData*>::const_iterator it = _dataLayers.begin();
@@ -1035,7 +2309,8 @@ void LayeredTexture::updateTilingInfoIfNeeded() const
 
     for ( ; it!=_dataLayers.end(); it++ )
     {
-	if ( !(*it)->_image.get() || (*it)->_id==_compositeLayerId )
+	if ( !(*it)->_image.get() || (*it)->_id==_compositeLayerId ||
+	     (*it)->_id==_overflowLayerId )
 	    continue;
 
 	const osg::Vec2f scale( (*it)->_scale.x() * (*it)->_imageScale.x(),
@@ -1059,6 +2334,9 @@ void LayeredTexture::updateTilingInfoIfNeeded() const
 	if ( minScale.y()<=0.0f || scale.y()<minScale.y() )
 	    minScale.y() = scale.y();
 
+	if ( _useNonPowerOf2Textures )
+	    continue;
+
 	if ( ( minNoPow2Size.x()<=0.0f || layerSize.x()<minNoPow2Size.x()) &&
 	     (*it)->_image->s() != getTextureSize((*it)->_image->s()) )
 	    minNoPow2Size.x() = layerSize.x();
@@ -1076,6 +2354,17 @@ void LayeredTexture::updateTilingInfoIfNeeded() const
     _tilingInfo->_smallestScale = minScale;
     _tilingInfo->_maxTileSize = osg::Vec2f( minNoPow2Size.x() / minScale.x(),
 					    minNoPow2Size.y() / minScale.y() );
+
+    // Existing tiles still fit if only layers inside the envelope moved
+    if ( !oldInfo._needsUpdate &&
+	 _tilingInfo->_envelopeOrigin==oldInfo._envelopeOrigin &&
+	 _tilingInfo->_envelopeSize==oldInfo._envelopeSize &&
+	 _tilingInfo->_smallestScale==oldInfo._smallestScale &&
+	 _tilingInfo->_maxTileSize==oldInfo._maxTileSize )
+    {
+	_tilingInfo->_retilingNeeded = oldInfo._retilingNeeded;
+	refitTileStateSets();
+    }
 }
 
 
@@ -1112,7 +2401,8 @@ void LayeredTexture::planTiling( int brickSize, std::vector<float>& xTickMarks,
     updateTilingInfoIfNeeded();
     _tilingInfo->_retilingNeeded = false; 
 
-    const int textureSize = getTextureSize( brickSize );
+    const int textureSize = _useNonPowerOf2Textures ? brickSize
+						    : getTextureSize(brickSize);
     osgGeo::Vec2i safeTileSize( textureSize, textureSize );
 
     const osg::Vec2f& maxTileSize = _tilingInfo->_maxTileSize;
@@ -1124,13 +2414,16 @@ void LayeredTexture::planTiling( int brickSize, std::vector<float>& xTickMarks,
 
     const osg::Vec2f& size = _tilingInfo->_envelopeSize;
     const osg::Vec2f& minScale = _tilingInfo->_smallestScale;
-    divideAxis( size.x()/minScale.x(), safeTileSize.x(), xTickMarks );
-    divideAxis( size.y()/minScale.y(), safeTileSize.y(), yTickMarks );
+    divideAxis( size.x()/minScale.x(), safeTileSize.x(), xTickMarks,
+		_useNonPowerOf2Textures );
+    divideAxis( size.y()/minScale.y(), safeTileSize.y(), yTickMarks,
+		_useNonPowerOf2Textures );
 }
 
 
 void LayeredTexture::divideAxis( float totalSize, int brickSize,
-				 std::vector<float>& tickMarks )
+				 std::vector<float>& tickMarks,
+				 bool evenBricks )
 {
     if ( totalSize <= 1.0f ) 
     {
@@ -1143,10 +2436,23 @@ void LayeredTexture::divideAxis( float totalSize, int brickSize,
     // One to avoid seam (lower LOD needs more), one because layers
     // may mutually disalign.
 
-    const int minBrickSize = getTextureSize( overlap+1 );
+    const int minBrickSize = evenBricks ? overlap+1 : getTextureSize(overlap+1);
     if ( brickSize < minBrickSize )
 	brickSize = minBrickSize;
 
+    if ( evenBricks )
+    {
+	// Equal bricks rather than a small remainder brick
+	const int nrBricks = (int) ceil( (totalSize-1.0f)/(brickSize-overlap) );
+	const float step = (totalSize-1.0f) / nrBricks;
+
+	for ( int idx=0; idx<nrBricks; idx++ )
+	    tickMarks.push_back( floor(idx*step) );
+
+	tickMarks.push_back( totalSize-1.0f );
+	return;
+    }
+
     float cur = 0.0f;
 
     while ( true )
@@ -1219,10 +2525,28 @@ static void copyImageTile( const osg::Image& srcImage, osg::Image& tileImage, co
 }
 
 
+static void registerTileImage( LayeredTextureData& layer, osg::Image* tileImage, bool useImageStride )
+{
+    // Only views on the layer image need dirtying on its change
+    if ( !useImageStride || !tileImage )
+	return;
+
+    for ( int idx=layer._tileImages.size()-1; idx>=0; idx-- )
+    {
+	if ( layer._tileImages[idx].get()==tileImage )
+	    return;
+    }
+
+    layer._tileImages.push_back( tileImage );
+    layer._tileSourceData = layer._image->data();
+}
+
+
 osg::StateSet* LayeredTexture::createCutoutStateSet(const osg::Vec2f& origin, const osg::Vec2f& opposite, std::vector<LayeredTexture::TextureCoordData>& tcData ) const
 {
     tcData.clear();
     osg::ref_ptr<osg::StateSet> stateset = new osg::StateSet;
+    std::map<int,TileLayerCutout> tileCutouts;
 
     const osg::Vec2f smallestScale = _tilingInfo->_smallestScale;
     osg::Vec2f globalOrigin( smallestScale.x() * (origin.x()+0.5),
@@ -1236,120 +2560,365 @@ osg::StateSet* LayeredTexture::createCutoutStateSet(const osg::Vec2f& origin, co
     for ( int idx=nrDataLayers()-1; idx>=0; idx-- )
     {
 	LayeredTextureData* layer = _dataLayers[idx];
-	if ( layer->_textureUnit < 0 )
+	if ( layer->_textureUnit<0 || layer->_packLayerId>=0 )
 	    continue;
 
-	const osg::Vec2f localOrigin = layer->getLayerCoord( globalOrigin );
-	const osg::Vec2f localOpposite = layer->getLayerCoord( globalOpposite );
-
-	const osg::Image* srcImage = layer->_image;
-	if ( !srcImage || !srcImage->s() || !srcImage->t() )
+	TileLayerCutout cutout;
+	if ( !computeTileCutout(*layer,globalOrigin,globalOpposite,cutout) )
 	    continue;
 
-	osgGeo::Vec2i size( (int) ceil(localOpposite.x()+0.5),
-			    (int) ceil(localOpposite.y()+0.5) );
+	const osg::Vec2f& tc00 = cutout._tc00;
+	const osg::Vec2f& tc11 = cutout._tc11;
+	const osg::Vec2f tc01( tc11.x(), tc00.y() );
+	const osg::Vec2f tc10( tc00.x(), tc11.y() );
+
+	tcData.push_back( TextureCoordData( layer->_textureUnit, tc00, tc01, tc10, tc11 ) );
+
+	cutout._geometryTc00 = tc00;
+	cutout._geometryTc11 = tc11;
+	cutOutTileTexture( *layer, cutout );
+
+	stateset->setTextureAttributeAndModes( layer->_textureUnit, cutout._texture.get() );
+	tileCutouts[layer->_textureUnit] = cutout;
+    }
+
+    if ( _useShaders )
+    {
+	// Specialized and refitted again in the update traversal
+	stateset->setDataVariance( osg::Object::DYNAMIC );
+
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileStateSets->_mutex );
+	_tileStateSets->purge();
+
+	_tileStateSets->_tiles.push_back( TileStateSetInfo() );
+	TileStateSetInfo& tile = _tileStateSets->_tiles.back();
+	tile._stateset = stateset;
+	tile._globalOrigin = globalOrigin;
+	tile._globalOpposite = globalOpposite;
+	tile._cutouts.swap( tileCutouts );
+
+	specializeTileStateSet( tile );
+    }
+
+    return stateset.release();
+}
+
+
+bool LayeredTexture::computeTileCutout( const LayeredTextureData& layer, const osg::Vec2f& globalOrigin, const osg::Vec2f& globalOpposite, TileLayerCutout& cutout ) const
+{
+    const osg::Image* srcImage = layer._image;
+    if ( !srcImage || !srcImage->s() || !srcImage->t() )
+	return false;
+
+    const osg::Vec2f localOrigin = layer.getLayerCoord( globalOrigin );
+    const osg::Vec2f localOpposite = layer.getLayerCoord( globalOpposite );
+
+    osgGeo::Vec2i size( (int) ceil(localOpposite.x()+0.5),
+			(int) ceil(localOpposite.y()+0.5) );
+
+    osgGeo::Vec2i overshoot( size.x()-srcImage->s(),
+			     size.y()-srcImage->t() );
+    if ( overshoot.x() > 0 )
+    {
+	size.x() -= overshoot.x();
+	overshoot.x() = 0;
+    }
+    if ( overshoot.y() > 0 )
+    {
+	size.y() -= overshoot.y();
+	overshoot.y() = 0;
+    }
+
+    osgGeo::Vec2i tileOrigin( (int) floor(localOrigin.x()-0.5),
+			      (int) floor(localOrigin.y()-0.5) );
+    if ( tileOrigin.x() < 0 )
+	tileOrigin.x() = 0;
+    else
+	size.x() -= tileOrigin.x();
+
+    if ( tileOrigin.y() < 0 )
+	tileOrigin.y() = 0;
+    else
+	size.y() -= tileOrigin.y();
+
+    if ( size.x()<1 || size.y()<1 )
+    {
+	size = osgGeo::Vec2i( 1, 1 );
+	tileOrigin = osgGeo::Vec2i( 0, 0 );
+    }
+
+    cutout._usedOrigin = tileOrigin;
+    cutout._usedSize = size;
+
+    osgGeo::Vec2i tileSize(
+	    _useNonPowerOf2Textures ? size.x() : getTextureSize(size.x()),
+	    _useNonPowerOf2Textures ? size.y() : getTextureSize(size.y()) );
+    overshoot += tileSize - size;
+
+    if ( tileOrigin.x()<overshoot.x() || tileOrigin.y()<overshoot.y() )
+    {
+	std::cerr << "Unexpected texture size mismatch!" << std::endl;
+	overshoot = osgGeo::Vec2i( 0, 0 );
+	tileSize = size;
+    }
+
+    if ( overshoot.x() > 0 )
+	tileOrigin.x() -= overshoot.x();
+    if ( overshoot.y() > 0 )
+	tileOrigin.y() -= overshoot.y();
+
+    cutout._layerId = layer._id;
+    cutout._localOrigin = localOrigin;
+    cutout._localOpposite = localOpposite;
+    cutout._tileOrigin = tileOrigin;
+    cutout._tileSize = tileSize;
+    cutout._texture = 0;
+    setCutoutTexCoords( layer, cutout );
+    return true;
+}
+
 
-	osgGeo::Vec2i overshoot( size.x()-srcImage->s(),
-				 size.y()-srcImage->t() );
-	if ( overshoot.x() > 0 )
+void LayeredTexture::cutOutTileTexture( LayeredTextureData& layer, TileLayerCutout& cutout ) const
+{
+    const osg::Image* srcImage = layer._image;
+    const osgGeo::Vec2i& tileOrigin = cutout._tileOrigin;
+    const osgGeo::Vec2i& tileSize = cutout._tileSize;
+
+    TileTextureKey key = getTileTextureKey( layer, tileOrigin, tileSize,
+			    _useImageStride, _useNonPowerOf2Textures );
+    key._wrapS = cutout._wrapS;
+    key._wrapT = cutout._wrapT;
+
+    {
+	OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileTextureCache->_mutex );
+	cutout._texture = _tileTextureCache->get( key );
+	if ( cutout._texture.valid() )
 	{
-	    size.x() -= overshoot.x();
-	    overshoot.x() = 0;
+	    registerTileImage( layer, cutout._texture->getImage(), _useImageStride );
+	    return;
 	}
-	if ( overshoot.y() > 0 )
+    }
+
+    osg::ref_ptr<osg::Image> tileImage = new osg::Image;
+
+#ifdef USE_IMAGE_STRIDE
+    if ( _useImageStride )
+    {
+	// User data keeps the viewed image alive as long as the tile
+	osg::Image* si = const_cast<osg::Image*>(srcImage);
+	tileImage->setUserData( si );
+	tileImage->setImage( tileSize.x(), tileSize.y(), si->r(), si->getInternalTextureFormat(), si->getPixelFormat(), si->getDataType(), si->data(tileOrigin.x(),tileOrigin.y()), osg::Image::NO_DELETE, si->getPacking(), si->s() ); 
+    }
+    else
+#endif
+	copyImageTile( *srcImage, *tileImage, tileOrigin, tileSize );
+
+    osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D( tileImage.get() );
+    texture->setWrap( osg::Texture::WRAP_S, cutout._wrapS );
+    texture->setWrap( osg::Texture::WRAP_T, cutout._wrapT );
+
+    osg::Texture::FilterMode filterMode = layer._filterType==Nearest ? osg::Texture::NEAREST : osg::Texture::LINEAR;
+    texture->setFilter( osg::Texture::MAG_FILTER, filterMode );
+
+    filterMode = layer._filterType==Nearest ? osg::Texture::NEAREST_MIPMAP_NEAREST : osg::Texture::LINEAR_MIPMAP_LINEAR;
+    texture->setFilter( osg::Texture::MIN_FILTER, filterMode );
+
+    texture->setBorderColor( layer._borderColor );
+
+    if ( _useNonPowerOf2Textures )
+	texture->setResizeNonPowerOfTwoHint( false );
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileTextureCache->_mutex );
+    const unsigned int nrBytes = tileImage->getTotalSizeInBytes();
+    cutout._texture = _tileTextureCache->add( key, texture.get(), nrBytes );
+    registerTileImage( layer, cutout._texture->getImage(), _useImageStride );
+}
+
+
+void LayeredTexture::refitTileStateSets() const
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileStateSets->_mutex );
+    _tileStateSets->purge();
+
+    std::vector<TileStateSetInfo>::iterator it = _tileStateSets->_tiles.begin();
+    for ( ; it!=_tileStateSets->_tiles.end(); it++ )
+    {
+	osg::StateSet& stateset = *it->_stateset;
+
+	std::map<int,TileLayerCutout>::iterator cit = it->_cutouts.begin();
+	for ( ; cit!=it->_cutouts.end(); cit++ )
 	{
-	    size.y() -= overshoot.y();
-	    overshoot.y() = 0;
+	    TileLayerCutout& cutout = cit->second;
+	    const int idx = getDataLayerIndex( cutout._layerId );
+	    if ( idx<0 || _dataLayers[idx]->_textureUnit!=cit->first )
+		continue;
+
+	    LayeredTextureData& layer = *_dataLayers[idx];
+	    TileLayerCutout needed;
+	    if ( !computeTileCutout(layer,it->_globalOrigin,it->_globalOpposite,needed) )
+		continue;
+
+	    if ( !reuseCutoutTexture(layer,cutout,needed) )
+	    {
+		cutOutTileTexture( layer, needed );
+
+		// Specialized tiles may not bind the textures they do not use
+		if ( stateset.getTextureAttribute(cit->first,osg::StateAttribute::TEXTURE) )
+		    stateset.setTextureAttributeAndModes( cit->first, needed._texture.get() );
+	    }
+
+	    needed._geometryTc00 = cutout._geometryTc00;
+	    needed._geometryTc11 = cutout._geometryTc11;
+	    cutout = needed;
+
+	    setTileTextureMatrix( stateset, cit->first, cutout );
 	}
+    }
+}
 
-	osgGeo::Vec2i tileOrigin( (int) floor(localOrigin.x()-0.5),
-				  (int) floor(localOrigin.y()-0.5) );
-	if ( tileOrigin.x() < 0 )
-	    tileOrigin.x() = 0;
-	else
-	    size.x() -= tileOrigin.x();
 
-	if ( tileOrigin.y() < 0 )
-	    tileOrigin.y() = 0;
-	else
-	    size.y() -= tileOrigin.y();
+void LayeredTexture::specializeTileStateSet( TileStateSetInfo& tile ) const
+{
+    const ProcessPlan& pp = *_processPlan;
+    osg::StateSet& stateset = *tile._stateset;
 
-	if ( size.x()<1 || size.y()<1 )
+    std::vector<int> tileUnits;
+    std::vector<LayerProcess*> tileProcs;
+    bool needColSeqTexture = false;
+    bool overflowStage = false;
+    bool specialize = _useShaders && !pp._needsUpdate &&
+		      !_fragmentShaderCode.empty();
+
+    if ( specialize )
+    {
+	std::vector<int> ids;
+	if ( getDataLayerIndex(_stackUndefLayerId)>=0 )
+	    ids.push_back( _stackUndefLayerId );
+
+	bool isVisible = false;
+	bool isOpaque = false;
+	std::vector<LayerProcess*>::const_reverse_iterator it;
+	it = _processes.rbegin();
+	for ( int nr=pp._nrProc; it!=_processes.rend() && nr>0; it++, nr-- )
 	{
-	    size = osgGeo::Vec2i( 1, 1 );
-	    tileOrigin = osgGeo::Vec2i( 0, 0 );
+	    const TransparencyType tt = (*it)->getTransparencyType( false,
+				&tile._globalOrigin, &tile._globalOpposite );
+	    if ( tt==FullyTransparent )
+		continue;
+
+	    // Emitted code and declared samplers both follow this list
+	    tileProcs.push_back( *it );
+	    isVisible = true;
+	    getProcessLayerIDs( *this, **it, ids );
+	    if ( (*it)->needsColorSequence() )
+		needColSeqTexture = true;
+
+	    // Layers below an opaque process are occluded in this tile
+	    if ( tt==Opaque )
+	    {
+		isOpaque = true;
+		break;
+	    }
 	}
 
-	const osgGeo::Vec2i tileSize( getTextureSize(size.x()),
-				      getTextureSize(size.y()) );
-	overshoot += tileSize - size;
+	overflowStage = !pp._overflowProcs.empty() && !isOpaque &&
+		getDataLayerTransparencyType( _overflowLayerId, 3,
+			&tile._globalOrigin, &tile._globalOpposite )!=FullyTransparent;
 
-	if ( tileOrigin.x()<overshoot.x() || tileOrigin.y()<overshoot.y() )
+	if ( overflowStage )
 	{
-	    std::cerr << "Unexpected texture size mismatch!" << std::endl;
-	    overshoot = osgGeo::Vec2i( 0, 0 );
-	    const_cast<osgGeo::Vec2i&>(tileSize) = size;
+	    isVisible = true;
+	    ids.push_back( _overflowLayerId );
 	}
 
-	if ( overshoot.x() > 0 )
-	    tileOrigin.x() -= overshoot.x();
-	if ( overshoot.y() > 0 )
-	    tileOrigin.y() -= overshoot.y();
+	// An empty stack still needs the output of the full program
+	specialize = isVisible;
 
-	osg::ref_ptr<osg::Image> tileImage = new osg::Image;
-
-#ifdef USE_IMAGE_STRIDE
-	osg::ref_ptr<osg::Image> si = const_cast<osg::Image*>(srcImage);
-	tileImage->setUserData( si.get() );
-	tileImage->setImage( tileSize.x(), tileSize.y(), si->r(), si->getInternalTextureFormat(), si->getPixelFormat(), si->getDataType(), si->data(tileOrigin.x(),tileOrigin.y()), osg::Image::NO_DELETE, si->getPacking(), si->s() ); 
+	std::vector<int>::const_iterator uit = pp._activeUnits.begin();
+	for ( ; uit!=pp._activeUnits.end(); uit++ )
+	{
+	    std::vector<int>::const_iterator iit = ids.begin();
+	    for ( ; iit!=ids.end(); iit++ )
+	    {
+		if ( *iit>0 && getDataLayerTextureUnit(*iit)==*uit )
+		{
+		    tileUnits.push_back( *uit );
+		    break;
+		}
+	    }
+	}
+    }
 
-	tileImage->ref();
-	layer->_tileImages.push_back( tileImage );
-#else
-	copyImageTile( *srcImage, *tileImage, tileOrigin, tileSize );
-#endif
+    std::string vertexCode, fragmentCode;
+    if ( specialize )
+    {
+	getVertexShaderCode( vertexCode, tileUnits );
+	if ( needColSeqTexture )
+	    tileUnits.push_back( 0 );
 
-	osg::Vec2f tc00, tc01, tc10, tc11;
-	tc00.x() = (localOrigin.x() - tileOrigin.x()) / tileSize.x();
-	tc00.y() = (localOrigin.y() - tileOrigin.y()) / tileSize.y();
-	tc11.x() = (localOpposite.x()-tileOrigin.x()) / tileSize.x();
-	tc11.y() = (localOpposite.y()-tileOrigin.y()) / tileSize.y();
-	tc01 = osg::Vec2f( tc11.x(), tc00.y() );
-	tc10 = osg::Vec2f( tc00.x(), tc11.y() );
+	getFragmentShaderCode( fragmentCode, tileUnits, tileProcs,
+			       pp._stackIsOpaque, overflowStage );
+    }
 
-	tcData.push_back( TextureCoordData( layer->_textureUnit, tc00, tc01, tc10, tc11 ) );
+    if ( specialize && ( vertexCode!=_vertexShaderCode ||
+			 fragmentCode!=_fragmentShaderCode ) )
+    {
+	osg::ref_ptr<osg::Program> program =
+		ShaderUtility::getOrCreateProgram( vertexCode, fragmentCode );
+	stateset.setAttributeAndModes( program.get() );
+    }
+    else
+    {
+	stateset.removeAttribute( osg::StateAttribute::PROGRAM );
+	specialize = false;
+    }
 
-	osg::Texture::WrapMode xWrapMode = osg::Texture::CLAMP_TO_EDGE;
-	if ( layer->_borderColor[0]>=0.0f && (tc00.x()<0.0f || tc11.x()>1.0f) )
-	    xWrapMode = osg::Texture::CLAMP_TO_BORDER;
+    std::map<int,TileLayerCutout>::const_iterator it;
+    for ( it=tile._cutouts.begin(); it!=tile._cutouts.end(); it++ )
+    {
+	const bool isUsed = !specialize ||
+	    std::find(tileUnits.begin(),tileUnits.end(),it->first)!=tileUnits.end();
 
-	osg::Texture::WrapMode yWrapMode = osg::Texture::CLAMP_TO_EDGE;
-	if ( layer->_borderColor[0]>=0.0f && (tc00.y()<0.0f || tc11.y()>1.0f) )
-	    yWrapMode = osg::Texture::CLAMP_TO_BORDER;
+	if ( isUsed )
+	    stateset.setTextureAttributeAndModes( it->first, it->second._texture.get() );
+	else
+	    stateset.removeTextureAttribute( it->first, osg::StateAttribute::TEXTURE );
+    }
+}
 
-	osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D( tileImage.get() );
-	texture->setWrap( osg::Texture::WRAP_S, xWrapMode );
-	texture->setWrap( osg::Texture::WRAP_T, yWrapMode );
 
-	osg::Texture::FilterMode filterMode = layer->_filterType==Nearest ? osg::Texture::NEAREST : osg::Texture::LINEAR;
-	texture->setFilter( osg::Texture::MAG_FILTER, filterMode );
+void LayeredTexture::specializeTileStateSets()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileStateSets->_mutex );
+    _tileStateSets->purge();
 
-	filterMode = layer->_filterType==Nearest ? osg::Texture::NEAREST_MIPMAP_NEAREST : osg::Texture::LINEAR_MIPMAP_LINEAR;
-	texture->setFilter( osg::Texture::MIN_FILTER, filterMode );
+    std::vector<TileStateSetInfo>::iterator it = _tileStateSets->_tiles.begin();
+    for ( ; it!=_tileStateSets->_tiles.end(); it++ )
+	specializeTileStateSet( *it );
+}
 
-	texture->setBorderColor( layer->_borderColor );
 
-	stateset->setTextureAttributeAndModes( layer->_textureUnit, texture.get() );
-    }
+osg::StateSet* LayeredTexture::getSetupStateSet()
+{
+    // Users without update traversal keep the polling in cull
+    if ( !_setupStateSet || !_hasFrameUpdates )
+	updateSetupStateSet();
 
-    return stateset.release();
+    return _setupStateSet;
 }
 
 
-osg::StateSet* LayeredTexture::getSetupStateSet()
+void LayeredTexture::frameUpdate( int frameNumber )
 {
+    _hasFrameUpdates = true;
+
+    // Another node sharing this texture may have retiled this frame
+    if ( frameNumber>=0 && frameNumber==_lastFrameUpdate &&
+	 !_updateSetupStateSet && !_tilingInfo->_retilingNeeded )
+	return;
+
+    _lastFrameUpdate = frameNumber;
     updateSetupStateSet();
-    return _setupStateSet;
 }
 
 
@@ -1360,21 +2929,31 @@ void LayeredTexture::updateSetupStateSet()
     if ( !_setupStateSet )
     {
 	_setupStateSet = new osg::StateSet;
+	// Modified in the update traversal
+	_setupStateSet->setDataVariance( osg::Object::DYNAMIC );
 	_updateSetupStateSet = true;
     }
 
-    checkForModifiedImages();
-
     std::vector<LayerProcess*>::iterator it = _processes.begin();
     for ( ; it!=_processes.end(); it++ )
 	(*it)->checkForModifiedColorSequence();
 
+    // Only image modifications can be limited to part of the composite
+    if ( _updateSetupStateSet )
+	_compositeDirtyAll = true;
+
+    checkForModifiedImages();
+
     if ( _updateSetupStateSet )
     {
 	_compositeLayerUpdate = true;
+	_processPlan->_needsUpdate = true;
 
 	if ( _useShaders )
+	{
+	    updateOverflowLayer();
 	    buildShaders();
+	}
 	else
 	    createCompositeTexture();
 
@@ -1391,11 +2970,20 @@ void LayeredTexture::checkForModifiedImages()
     for ( ; it!=_dataLayers.end(); it++ )
     {
 	(*it)->_imageModifiedFlag = false;
+
+	if ( (*it)->_subImageModified )
+	{
+	    (*it)->_subImageModified = false;
+	    (*it)->_imageModifiedFlag = true;
+	    _updateSetupStateSet = true;
+	}
+
 	if ( (*it)->_imageSource.get() )
 	{
 	    const int modifiedCount = (*it)->_imageSource->getModifiedCount();
 	    if ( modifiedCount!=(*it)->_imageModifiedCount )
 	    {
+		expandCompositeDirtyRegion( **it );
 		setDataLayerImage( (*it)->_id, (*it)->_imageSource );
 		(*it)->_imageModifiedFlag = true;
 		_updateSetupStateSet = true;
@@ -1412,66 +3000,160 @@ void LayeredTexture::checkForModifiedImages()
 }
 
 
-void LayeredTexture::buildShaders()
+const ProcessPlan& LayeredTexture::updateProcessPlanIfNeeded()
 {
-    int nrUsedLayers;
-    std::vector<int> orderedLayerIDs;
-    bool stackIsOpaque;
-    const int nrProc = getProcessInfo( orderedLayerIDs, nrUsedLayers, &stackIsOpaque );
+    ProcessPlan& pp = *_processPlan;
+    if ( !pp._needsUpdate )
+	return pp;
 
-    bool needColSeqTexture = false;
-    int minUnit = NR_TEXTURE_UNITS;
-    std::vector<int> activeUnits;
+    pp.reInit();
+    pp._needsUpdate = false;
+    pp._nrProc = getProcessInfo( pp._orderedLayerIDs, pp._nrUsedLayers,
+				 &pp._stackIsOpaque );
 
-    std::vector<int>::iterator it = orderedLayerIDs.begin();
-    for ( ; nrUsedLayers>0; it++, nrUsedLayers-- )
+    std::vector<int>::const_iterator iit = pp._orderedLayerIDs.begin();
+    for ( int nr=pp._nrUsedLayers; nr>0; iit++, nr-- )
     {
-	if ( *it )
+	if ( *iit )
 	{
-	    const int unit = getDataLayerTextureUnit( *it );
-	    activeUnits.push_back( unit );
-	    if ( unit<minUnit )
-		minUnit = unit;
+	    // Packed layers share their unit
+	    const int unit = getDataLayerTextureUnit( *iit );
+	    if ( std::find(pp._activeUnits.begin(),pp._activeUnits.end(),
+			   unit)!=pp._activeUnits.end() )
+		continue;
+
+	    pp._activeUnits.push_back( unit );
+	    if ( unit<pp._minUnit )
+		pp._minUnit = unit;
 	}
 	else
-	    needColSeqTexture = true;
+	    pp._needColSeqTexture = true;
+    }
+
+    std::vector<LayerProcess*>::const_reverse_iterator pit;
+    for ( pit=_processes.rbegin(); pit!=_processes.rend(); pit++ )
+    {
+	const TransparencyType tt = (*pit)->getTransparencyType();
+	if ( tt==FullyTransparent )
+	    continue;
+
+	pp._activeProcs.push_back( *pit );
+	if ( tt==Opaque )
+	    break;
+    }
+
+    if ( !_useShaders || pp._stackIsOpaque )
+	return pp;
+
+    pit = _processes.rbegin() + std::min( pp._nrProc, nrProcesses() );
+    for ( ; pit!=_processes.rend(); pit++ )
+    {
+	const TransparencyType tt = (*pit)->getTransparencyType();
+	if ( tt==FullyTransparent )
+	    continue;
+
+	pp._overflowProcs.push_back( *pit );
+	if ( tt==Opaque )
+	    break;
+    }
+
+    if ( !pp._overflowProcs.empty() )
+    {
+	const int unit = getDataLayerTextureUnit( _overflowLayerId );
+	pp._activeUnits.push_back( unit );
+	if ( unit<pp._minUnit )
+	    pp._minUnit = unit;
     }
 
-    if ( minUnit<0 || (minUnit==0 && needColSeqTexture) )
+    return pp;
+}
+
+
+void LayeredTexture::buildShaders()
+{
+    const ProcessPlan& pp = updateProcessPlanIfNeeded();
+    const bool needColSeqTexture = pp._needColSeqTexture;
+    std::vector<int> activeUnits = pp._activeUnits;
+
+    if ( pp._minUnit<0 || (pp._minUnit==0 && needColSeqTexture) )
     {
 	_tilingInfo->_retilingNeeded = true;
 	return;
     }
 
-    _setupStateSet->clear();
-
-    std::string code;
-    getVertexShaderCode( code, activeUnits );
-    osg::ref_ptr<osg::Shader> vertexShader = new osg::Shader( osg::Shader::VERTEX, code );
+    std::string vertexCode;
+    getVertexShaderCode( vertexCode, activeUnits );
 
     if ( needColSeqTexture )
     {
-	createColSeqTexture();
+	const int texSize = getTextureSize( nrProcesses() );
+	for ( int idx=0; idx<nrProcesses(); idx++ )
+	    _processes[idx]->setColorSequenceTextureCoord( (idx+0.5)/texSize );
+
 	activeUnits.push_back( 0 );
     }
 
-    getFragmentShaderCode( code, activeUnits, nrProc, stackIsOpaque );
-    osg::ref_ptr<osg::Shader> fragmentShader = new osg::Shader( osg::Shader::FRAGMENT, code );
+    std::vector<LayerProcess*> procs;
+    std::vector<LayerProcess*>::const_reverse_iterator it = _processes.rbegin();
+    for ( int nr=pp._nrProc; it!=_processes.rend() && nr>0; it++, nr-- )
+    {
+	if ( (*it)->getTransparencyType()!=FullyTransparent )
+	    procs.push_back( *it );
+    }
+
+    std::string fragmentCode;
+    getFragmentShaderCode( fragmentCode, activeUnits, procs,
+			   pp._stackIsOpaque, !pp._overflowProcs.empty() );
+
+    // Colors and opacities are uniforms, so only a structural change
+    // of the process stack needs a new program.
+    if ( vertexCode!=_vertexShaderCode || fragmentCode!=_fragmentShaderCode ||
+	 !_setupStateSet->getAttribute(osg::StateAttribute::PROGRAM) )
+    {
+	_setupStateSet->clear();
+
+	// Identical process stacks share one compiled program
+	osg::ref_ptr<osg::Program> program =
+		ShaderUtility::getOrCreateProgram( vertexCode, fragmentCode );
+	_setupStateSet->setAttributeAndModes( program.get() );
+
+	char samplerName[20];
+	std::vector<int>::const_iterator it = activeUnits.begin();
+	for ( ; it!=activeUnits.end(); it++ )
+	{
+	    sprintf( samplerName, "texture%d", *it );
+	    _setupStateSet->addUniform( new osg::Uniform(samplerName, *it) );
+	}
+
+	_vertexShaderCode = vertexCode;
+	_fragmentShaderCode = fragmentCode;
+    }
+
+    if ( needColSeqTexture )
+	createColSeqTexture();
 
-    osg::ref_ptr<osg::Program> program = new osg::Program;
+    setShaderUniforms();
+    setRenderingHint( pp._stackIsOpaque );
+    specializeTileStateSets();
+}
 
-    program->addShader( vertexShader.get() );
-    program->addShader( fragmentShader.get() );
-    _setupStateSet->setAttributeAndModes( program.get() );
 
-    char samplerName[20];
-    for ( it=activeUnits.begin(); it!=activeUnits.end(); it++ )
+void LayeredTexture::setShaderUniforms()
+{
+    char uniformName[40];
+    std::vector<LayeredTextureData*>::const_iterator lit = _dataLayers.begin();
+    for ( ; lit!=_dataLayers.end(); lit++ )
     {
-	sprintf( samplerName, "texture%d", *it );
-	_setupStateSet->addUniform( new osg::Uniform(samplerName, *it) );
+	sprintf( uniformName, "udfcolor%d", (*lit)->_id );
+	_setupStateSet->getOrCreateUniform( uniformName, osg::Uniform::FLOAT_VEC4 )->set( (*lit)->_undefColor );
     }
 
-    setRenderingHint( stackIsOpaque );
+    if ( getDataLayerIndex(_stackUndefLayerId)>=0 )
+	_setupStateSet->getOrCreateUniform( "stackudfcolor", osg::Uniform::FLOAT_VEC4 )->set( _stackUndefColor );
+
+    std::vector<LayerProcess*>::const_iterator pit = _processes.begin();
+    for ( ; pit!=_processes.end(); pit++ )
+	(*pit)->setShaderUniforms( *_setupStateSet );
 }
 
 
@@ -1488,13 +3170,16 @@ void LayeredTexture::setRenderingHint( bool stackIsOpaque )
 	_setupStateSet->setRenderingHint( osg::StateSet::TRANSPARENT_BIN );
     }
     else
+    {
+	_setupStateSet->removeAttribute( osg::StateAttribute::BLENDFUNC );
 	_setupStateSet->setRenderingHint( osg::StateSet::OPAQUE_BIN );
+    }
 }
 
 
 int LayeredTexture::getProcessInfo( std::vector<int>& layerIDs, int& nrUsedLayers, bool* stackIsOpaque ) const
 {
-    layerIDs.empty();
+    layerIDs.clear();
     std::vector<int> skippedIDs;
     int nrProc = 0;
     nrUsedLayers = 0;
@@ -1555,13 +3240,23 @@ int LayeredTexture::getProcessInfo( std::vector<int>& layerIDs, int& nrUsedLayer
 	if ( !nrUsedLayers )
 	{
 	    const int sz = layerIDs.size();
-	    if ( sz > NR_TEXTURE_UNITS )
+	    std::vector<std::vector<int> > groups;
+	    groupForPacking( layerIDs, sz, groups );
+
+	    // Processes that do not fit go to the overflow layer, which
+	    // needs a texture unit itself.
+	    bool overflowFollows = false;
+	    if ( _useShaders && transparency!=Opaque )
 	    {
-		nrUsedLayers = sz-nrPushed;
-		const bool assigningTextureUnits = !stackIsOpaque;  // Hacky
-		if ( assigningTextureUnits )
-		    std::cerr << "Earliest process(es) dropped for lack of texture units" << std::endl;
+		std::vector<LayerProcess*>::const_reverse_iterator nit = it;
+		for ( nit++; nit!=_processes.rend() && !overflowFollows; nit++ )
+		    overflowFollows = (*nit)->getTransparencyType()!=FullyTransparent;
 	    }
+
+	    const int maxNrUnits = overflowFollows ? NR_TEXTURE_UNITS-1
+						   : NR_TEXTURE_UNITS;
+	    if ( (int) groups.size() > maxNrUnits )
+		nrUsedLayers = sz-nrPushed;
 	    else
 	    {
 		nrProc++;
@@ -1598,8 +3293,6 @@ void LayeredTexture::createColSeqTexture()
 	const unsigned char* ptr = (*it)->getColorSequencePtr();
 	if ( ptr )
 	    memcpy( colSeqImage->data(0,idx), ptr, rowSize );
-
-	(*it)->setColorSequenceTextureCoord( (idx+0.5)/texSize );
     }
     osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D( colSeqImage );
     texture->setFilter( osg::Texture::MIN_FILTER, osg::Texture::NEAREST );
@@ -1610,18 +3303,24 @@ void LayeredTexture::createColSeqTexture()
 
 void LayeredTexture::assignTextureUnits()
 {
+    std::vector<int> unusedPackIds;
     std::vector<LayeredTextureData*>::iterator lit = _dataLayers.begin();
     for ( ; lit!=_dataLayers.end(); lit++ )
     {
 	(*lit)->cleanUp();
 	(*lit)->_textureUnit = -1;
+	(*lit)->_packLayerId = -1;
+	(*lit)->_packChannel = -1;
+
+	if ( !(*lit)->_packedIds.empty() )
+	    unusedPackIds.push_back( (*lit)->_id );
     }
 
     if ( _useShaders )
     {
-	std::vector<int> orderedLayerIDs;
-	int nrUsedLayers;
-	getProcessInfo( orderedLayerIDs, nrUsedLayers );
+	_processPlan->_needsUpdate = true;
+	const ProcessPlan& pp = updateProcessPlanIfNeeded();
+	int nrUsedLayers = pp._nrUsedLayers;
 
 	int unit = 0;	// Reserved for ColSeqTexture if needed
 
@@ -1631,23 +3330,204 @@ void LayeredTexture::assignTextureUnits()
 	if ( preloadUnusedLayers )
 	    nrUsedLayers = NR_TEXTURE_UNITS;
 
-	std::vector<int>::iterator iit = orderedLayerIDs.begin();
-	for ( ; iit!=orderedLayerIDs.end() && nrUsedLayers>0; iit++ )
+	std::vector<std::vector<int> > groups;
+	groupForPacking( pp._orderedLayerIDs, nrUsedLayers, groups );
+
+	std::vector<std::vector<int> >::const_iterator git = groups.begin();
+	for ( ; git!=groups.end(); git++ )
+	{
+	    if ( git->front()<=0 )
+		continue;
+
+	    if ( git->size()==1 )
+		setDataLayerTextureUnit( git->front(), (++unit)%NR_TEXTURE_UNITS );
+	    else
+		packDataLayers( *git, (++unit)%NR_TEXTURE_UNITS, unusedPackIds );
+	}
+
+	if ( !pp._overflowProcs.empty() )
 	{
-	    if ( (*iit)>0 )
-		setDataLayerTextureUnit( *iit, (++unit)%NR_TEXTURE_UNITS );
+	    if ( getDataLayerIndex(_overflowLayerId)==-1 )
+	    {
+		_overflowLayerId = addDataLayer();
+		setDataLayerBorderColor( _overflowLayerId,
+					 osg::Vec4f(0.0f,0.0f,0.0f,0.0f) );
+		_overflowKey.clear();
+	    }
 
-	    nrUsedLayers--;
+	    setDataLayerTextureUnit( _overflowLayerId, (++unit)%NR_TEXTURE_UNITS );
 	}
     }
     else
 	setDataLayerTextureUnit( _compositeLayerId, 0 );
 
+    if ( (!_useShaders || _processPlan->_overflowProcs.empty()) &&
+	 _overflowLayerId>=0 )
+    {
+	removeDataLayer( _overflowLayerId );
+	_overflowLayerId = -1;
+    }
+
+    std::vector<int>::const_iterator pit = unusedPackIds.begin();
+    for ( ; pit!=unusedPackIds.end(); pit++ )
+	removeDataLayer( *pit );
+
+    // Texture units in the plan are outdated now
+    _processPlan->_needsUpdate = true;
     _updateSetupStateSet = true;
     updateSetupStateSet();
 }
 
 
+void LayeredTexture::groupForPacking( const std::vector<int>& ids, int nr, std::vector<std::vector<int> >& groups ) const
+{
+    groups.clear();
+
+    for ( int idx=0; idx<nr && idx<(int) ids.size(); idx++ )
+    {
+	const int layerIdx = _useShaders && ids[idx]>0 ?
+			     getDataLayerIndex( ids[idx] ) : -1;
+
+	std::vector<std::vector<int> >::iterator it = groups.end();
+	if ( layerIdx!=-1 && canBePacked(*_dataLayers[layerIdx]) )
+	{
+	    for ( it=groups.begin(); it!=groups.end(); it++ )
+	    {
+		if ( it->size()>=4 || it->front()<=0 )
+		    continue;
+
+		const int frontIdx = getDataLayerIndex( it->front() );
+		if ( frontIdx!=-1 && canBePackedTogether(*_dataLayers[frontIdx],
+						    *_dataLayers[layerIdx]) )
+		    break;
+	    }
+	}
+
+	if ( it==groups.end() )
+	    groups.push_back( std::vector<int>(1,ids[idx]) );
+	else
+	    it->push_back( ids[idx] );
+    }
+}
+
+
+void LayeredTexture::packDataLayers( const std::vector<int>& group, int unit, std::vector<int>& unusedPackIds )
+{
+    // Reusing the pack layer of the same group keeps its tiles cached
+    int packId = -1;
+    std::vector<int>::iterator it = unusedPackIds.begin();
+    for ( ; it!=unusedPackIds.end(); it++ )
+    {
+	if ( _dataLayers[getDataLayerIndex(*it)]->_packedIds==group )
+	{
+	    packId = *it;
+	    unusedPackIds.erase( it );
+	    break;
+	}
+    }
+
+    if ( packId<0 )
+	packId = addDataLayer();
+
+    const LayeredTextureData& first = *_dataLayers[getDataLayerIndex(group.front())];
+    const int nrChannels = group.size();
+    const GLenum format = nrChannels==2 ? GL_LUMINANCE_ALPHA :
+			  nrChannels==3 ? GL_RGB : GL_RGBA;
+
+    LayeredTextureData& pack = *_dataLayers[getDataLayerIndex(packId)];
+    osg::ref_ptr<osg::Image> packImage =
+		    const_cast<osg::Image*>( pack._imageSource.get() );
+
+    if ( !packImage || pack._packedIds!=group ||
+	 packImage->s()!=first._image->s() ||
+	 packImage->t()!=first._image->t() )
+    {
+	packImage = new osg::Image;
+	packImage->allocateImage( first._image->s(), first._image->t(), 1,
+				  format, GL_UNSIGNED_BYTE );
+
+	for ( int idx=0; idx<nrChannels; idx++ )
+	{
+	    const osg::Image& srcImage =
+			*_dataLayers[getDataLayerIndex(group[idx])]->_image;
+	    copyPackedChannel( srcImage, *packImage, idx, osgGeo::Vec2i(0,0),
+			osgGeo::Vec2i(packImage->s(),packImage->t()) );
+	}
+
+	pack._packedIds = group;
+	setDataLayerImage( packId, packImage );
+    }
+
+    setDataLayerOrigin( packId, first._origin );
+    setDataLayerScale( packId, osg::Vec2f(first._scale.x()*first._imageScale.x(),
+					  first._scale.y()*first._imageScale.y()) );
+    setDataLayerFilterType( packId, first._filterType );
+
+    osg::Vec4f borderColor( -1.0f, -1.0f, -1.0f, -1.0f );
+    if ( getPackedBorderValue(first)>=0.0f )
+    {
+	borderColor = osg::Vec4f( 1.0f, 1.0f, 1.0f, 1.0f );
+	for ( int idx=0; idx<nrChannels; idx++ )
+	{
+	    const LayeredTextureData& layer =
+			*_dataLayers[getDataLayerIndex(group[idx])];
+	    borderColor[image2TextureChannel(idx,format)] =
+					    getPackedBorderValue( layer );
+	}
+    }
+
+    setDataLayerBorderColor( packId, borderColor );
+    setDataLayerTextureUnit( packId, unit );
+
+    for ( int idx=0; idx<nrChannels; idx++ )
+    {
+	LayeredTextureData& layer = *_dataLayers[getDataLayerIndex(group[idx])];
+	layer._textureUnit = unit;
+	layer._packLayerId = packId;
+	layer._packChannel = image2TextureChannel( idx, format );
+    }
+}
+
+
+void LayeredTexture::refreshPackedChannel( const LayeredTextureData& layer )
+{
+    const int packIdx = getDataLayerIndex( layer._packLayerId );
+    if ( packIdx==-1 )
+	return;
+
+    LayeredTextureData& pack = *_dataLayers[packIdx];
+    osg::Image* packImage = const_cast<osg::Image*>( pack._imageSource.get() );
+    const std::vector<int>& ids = pack._packedIds;
+    const int channel = std::find(ids.begin(),ids.end(),layer._id) - ids.begin();
+
+    if ( !packImage || channel>=(int) ids.size() || !canBePacked(layer) ||
+	 layer._image->s()!=packImage->s() || layer._image->t()!=packImage->t() )
+    {
+	_tilingInfo->_retilingNeeded = true;
+	return;
+    }
+
+    osgGeo::Vec2i origin( 0, 0 );
+    osgGeo::Vec2i size( packImage->s(), packImage->t() );
+
+    // Dirty rectangle does not apply to scaled image copies
+    if ( layer.hasDirtyRect() && layer._image==layer._imageSource )
+    {
+	origin.x() = std::max( layer._dirtyOrigin.x(), 0 );
+	origin.y() = std::max( layer._dirtyOrigin.y(), 0 );
+	size.x() = std::min( layer._dirtyOrigin.x()+layer._dirtySize.x(), size.x() ) - origin.x();
+	size.y() = std::min( layer._dirtyOrigin.y()+layer._dirtySize.y(), size.y() ) - origin.y();
+	if ( size.x()<1 || size.y()<1 )
+	    return;
+
+	touchDataLayerImage( pack._id, origin.x(), origin.y(), size.x(), size.y() );
+    }
+
+    copyPackedChannel( *layer._image, *packImage, channel, origin, size );
+    packImage->dirty();
+}
+
+
 void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<int>& activeUnits ) const
 {
     code =
@@ -1700,7 +3580,7 @@ void LayeredTexture::getVertexShaderCode( std::string& code, const std::vector<i
 }
 
 
-void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector<int>& activeUnits, int nrProc, bool stackIsOpaque ) const
+void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector<int>& activeUnits, const std::vector<LayerProcess*>& procs, bool stackIsOpaque, bool overflowStage ) const
 {
     code.clear();
     char line[100];
@@ -1711,8 +3591,26 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 	code += line;
     }
 
+    std::vector<LayeredTextureData*>::const_iterator lit = _dataLayers.begin();
+    for ( ; lit!=_dataLayers.end(); lit++ )
+    {
+	sprintf( line, "uniform vec4 udfcolor%d;\n", (*lit)->_id );
+	code += line;
+    }
+
+    for ( int idx=0; idx<nrProcesses(); idx++ )
+    {
+	sprintf( line, "uniform vec4 newudfcolor%d;\n", idx );
+	code += line;
+	sprintf( line, "uniform float opacity%d;\n", idx );
+	code += line;
+    }
+
     code += "\n";
     const bool stackUdf = getDataLayerIndex(_stackUndefLayerId)>=0;
+    if ( stackUdf )
+	code += "uniform vec4 stackudfcolor;\n\n";
+
     code += stackUdf ? "void process( float stackudf )\n" :
 		       "void process( void )\n";
     code += "{\n"
@@ -1722,12 +3620,9 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 	    "\n";
 
     int stage = 0;
-    std::vector<LayerProcess*>::const_reverse_iterator it = _processes.rbegin();
-    for ( ; it!=_processes.rend() && nrProc--; it++ )
+    std::vector<LayerProcess*>::const_iterator it = procs.begin();
+    for ( ; it!=procs.end(); it++ )
     {
-	if ( (*it)->getTransparencyType() == FullyTransparent )
-	    continue;
-
 	if ( stage )
 	{
 	    code += "\n"
@@ -1739,6 +3634,36 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 	(*it)->getShaderCode( code, stage++ );
     }
 
+    if ( overflowStage )
+    {
+	if ( stage )
+	{
+	    code += "\n"
+		    "    if ( gl_FragColor.a >= 1.0 )\n"
+		    "       return;\n"
+		    "\n";
+	}
+
+	// Already has opacities and undefs of its processes applied
+	std::string sample;
+	getDataLayerSampleCode( sample, _overflowLayerId );
+	sprintf( line, "    texcrd = gl_TexCoord[%d].st;\n",
+		 getDataLayerTextureUnit(_overflowLayerId) );
+	code += line;
+	code += "    col = " + sample + ";\n";
+
+	if ( stage++ )
+	{
+	    code += "    a = gl_FragColor.a;\n"
+		    "    b = col.a * (1.0-a);\n"
+		    "    gl_FragColor.a += b;\n"
+		    "    if ( gl_FragColor.a > 0.0 )\n"
+		    "        gl_FragColor.rgb = (a*gl_FragColor.rgb+b*col.rgb) / gl_FragColor.a;\n";
+	}
+	else
+	    code += "    gl_FragColor = col;\n";
+    }
+
     if ( !stage )
 	code += "    gl_FragColor = vec4(1.0,1.0,1.0,1.0);\n";
 
@@ -1755,27 +3680,23 @@ void LayeredTexture::getFragmentShaderCode( std::string& code, const std::vector
 	const int udfUnit = getDataLayerTextureUnit( _stackUndefLayerId );
 	sprintf( line, "    vec2 texcrd = gl_TexCoord[%d].st;\n", udfUnit );
 	code += line;
-	sprintf( line, "    float udf = texture2D( texture%d, texcrd )[%d];\n", udfUnit, _stackUndefChannel );
-	code += line;
+	std::string udfExpr;
+	getDataLayerSampleCode( udfExpr, _stackUndefLayerId, _stackUndefChannel );
+	code += "    float udf = " + udfExpr + ";\n";
 	code += "\n"
 		"    if ( udf < 1.0 )\n"
 		"        process( udf );\n"
 		"\n";
 
-	sprintf( line, "    vec4 udfcol = vec4(%.6f,%.6f,%.6f,%.6f);\n", _stackUndefColor[0], _stackUndefColor[1], _stackUndefColor[2], _stackUndefColor[3] );
-	code += line;
+	code += "    vec4 udfcol = stackudfcolor;\n";
 
+	// General blend, also covers transparent and opaque udfcol
 	code += "\n"
 		"    if ( udf >= 1.0 )\n"
 	    	"        gl_FragColor = udfcol;\n"
 		"    else if ( udf > 0.0 )\n";
 
-	if ( _stackUndefColor[3]<=0.0f )
-	    code += "        gl_FragColor.a *= 1.0-udf;\n";
-	else if ( _stackUndefColor[3]>=1.0f && stackIsOpaque )
-	    code += "        gl_FragColor = mix( gl_FragColor, udfcol, udf );\n";
-	else
-	    code += "    {\n"
+	code += "    {\n"
 		    "        if ( gl_FragColor.a > 0.0 )\n"
 		    "        {\n"
 		    "            vec4 col = gl_FragColor;\n"
@@ -1806,6 +3727,53 @@ void LayeredTexture::useShaders( bool yn )
 }
 
 
+void LayeredTexture::setMaxTileCacheSize( unsigned int nrBytes )
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _tileTextureCache->_mutex );
+    _tileTextureCache->_maxNrBytes = nrBytes;
+    _tileTextureCache->shrink();
+}
+
+
+void LayeredTexture::useNonPowerOf2Textures( bool yn )
+{
+    if ( _useNonPowerOf2Textures==yn )
+	return;
+
+    _useNonPowerOf2Textures = yn;
+    _tilingInfo->_needsUpdate = true;
+    _tilingInfo->_retilingNeeded = true;
+
+    // Forces (un)scaled copies to be remade by checkForModifiedImages()
+    std::vector<LayeredTextureData*>::iterator it = _dataLayers.begin();
+    for ( ; it!=_dataLayers.end(); it++ )
+    {
+	if ( (*it)->_imageSource.get() && (*it)->_id!=_compositeLayerId )
+	    (*it)->_imageModifiedCount = -1;
+    }
+}
+
+
+bool LayeredTexture::usesNonPowerOf2Textures() const
+{ return _useNonPowerOf2Textures; }
+
+
+void LayeredTexture::useImageStride( bool yn )
+{
+#ifdef USE_IMAGE_STRIDE
+    if ( _useImageStride==yn )
+	return;
+
+    _useImageStride = yn;
+    _tilingInfo->_retilingNeeded = true;
+#endif
+}
+
+
+bool LayeredTexture::usesImageStride() const
+{ return _useImageStride; }
+
+
 void LayeredTexture::setMaxTextureCopySize( unsigned int width_x_height )
 {
     _maxTextureCopySize = width_x_height;
@@ -1820,69 +3788,170 @@ void LayeredTexture::setMaxTextureCopySize( unsigned int width_x_height )
 }
 
 
-void LayeredTexture::createCompositeTexture()
+// Rows per block handed to a compositing thread
+static const int sCompositeBlockRows = 32;
+// Below this nr of pixels, starting threads costs more than it gains
+static const int sMinParallelCompositeSize = 64*64;
+
+
+/* Composites the row blocks firstBlock, firstBlock+blockStep, ... of a
+   region of the composite image. Blocks are interleaved to balance the
+   load. */
+
+class CompositeTextureBuilder : public OpenThreads::Thread
 {
-    if ( !_compositeLayerUpdate )
+public:
+			CompositeTextureBuilder(const LayeredTexture& lt,
+				osg::Image& image,
+				const std::vector<LayerProcess*>& activeProcs,
+				const osg::Vec2f& scale,
+				const osgGeo::Vec2i& regionStart,
+				const osgGeo::Vec2i& regionStop,
+				int firstBlock,int blockStep,
+				bool applyStackUndef)
+			    : _layTex( lt ), _image( image )
+			    , _activeProcs( activeProcs ), _scale( scale )
+			    , _start( regionStart ), _stop( regionStop )
+			    , _firstBlock( firstBlock ), _blockStep( blockStep )
+			    , _applyStackUndef( applyStackUndef )
+			{}
+
+    void		run()
+			{
+			    int row = _start.y()+_firstBlock*sCompositeBlockRows;
+			    for ( ; row<_stop.y();
+				    row+=_blockStep*sCompositeBlockRows )
+			    {
+				int lastRow = row+sCompositeBlockRows;
+				if ( lastRow>_stop.y() )
+				    lastRow = _stop.y();
+
+				_layTex.compositeRows( _image, row, lastRow,
+						       _start.x(), _stop.x(),
+						       _activeProcs, _scale,
+						       _applyStackUndef );
+			    }
+			}
+
+protected:
+    const LayeredTexture&		_layTex;
+    osg::Image&				_image;
+    const std::vector<LayerProcess*>&	_activeProcs;
+    const osg::Vec2f			_scale;
+    const osgGeo::Vec2i			_start;
+    const osgGeo::Vec2i			_stop;
+    const int				_firstBlock;
+    const int				_blockStep;
+    const bool				_applyStackUndef;
+};
+
+
+static void expandDirtyRegion( const LayeredTextureData& layer, bool& dirtyAll, osg::Vec2f& dirtyMin, osg::Vec2f& dirtyMax )
+{
+    if ( !layer.hasDirtyRect() )
+    {
+	dirtyAll = true;
 	return;
+    }
+
+    // Margin covers linear filtering and power-of-2 scaled copies
+    const int margin = 2;
+    const osg::Vec2f& scale = layer._scale;
+
+    const osg::Vec2f minCoord = layer._origin + osg::Vec2f(
+			scale.x() * (layer._dirtyOrigin.x()-margin),
+			scale.y() * (layer._dirtyOrigin.y()-margin) );
+
+    const osg::Vec2f maxCoord = layer._origin + osg::Vec2f(
+	    scale.x() * (layer._dirtyOrigin.x()+layer._dirtySize.x()+margin),
+	    scale.y() * (layer._dirtyOrigin.y()+layer._dirtySize.y()+margin) );
+
+    const bool isEmpty = dirtyMin.x() > dirtyMax.x();
 
-    _compositeLayerUpdate = false;
-    updateTilingInfoIfNeeded();
-    const osgGeo::TilingInfo& ti = *_tilingInfo;
+    for ( int dim=0; dim<2; dim++ )
+    {
+	if ( isEmpty || minCoord[dim]<dirtyMin[dim] )
+	    dirtyMin[dim] = minCoord[dim];
+	if ( isEmpty || maxCoord[dim]>dirtyMax[dim] )
+	    dirtyMax[dim] = maxCoord[dim];
+    }
+}
 
-    const int width  = (int) ceil( ti._envelopeSize.x()/ti._smallestScale.x() );
-    const int height = (int) ceil( ti._envelopeSize.y()/ti._smallestScale.y() );
-    if ( width<1 || height<1 )
-	return;
 
-    const osg::Vec2f scale( ti._envelopeSize.x()/float(width),
-			    ti._envelopeSize.y()/float(height) );
+void LayeredTexture::expandCompositeDirtyRegion( const LayeredTextureData& layer )
+{
+    expandDirtyRegion( layer, _compositeDirtyAll, _compositeDirtyMin,
+		       _compositeDirtyMax );
 
-    const int idx = getDataLayerIndex( _compositeLayerId );
-    osg::Image* image = const_cast<osg::Image*>( _dataLayers[idx]->_image.get() );
+    // The overflow layer only depends on the layers of its processes
+    std::vector<int> ids( 1, _stackUndefLayerId );
+    const std::vector<LayerProcess*>& procs = _processPlan->_overflowProcs;
+    std::vector<LayerProcess*>::const_iterator it = procs.begin();
+    for ( ; it!=procs.end(); it++ )
+	getProcessLayerIDs( *this, **it, ids );
 
-    if ( !image || width!=image->s() || height!=image->t() )
+    if ( std::find(ids.begin(),ids.end(),layer._id)!=ids.end() )
     {
-	image = new osg::Image;
-	image->allocateImage( width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+	expandDirtyRegion( layer, _overflowDirtyAll, _overflowDirtyMin,
+			   _overflowDirtyMax );
     }
+}
 
-    _dataLayers[idx]->_origin = ti._envelopeOrigin;
-    _dataLayers[idx]->_scale = scale;
 
+void LayeredTexture::compositeRows( osg::Image& image, int firstRow, int lastRow, int firstCol, int lastCol, const std::vector<LayerProcess*>& activeProcs, const osg::Vec2f& scale, bool applyStackUndef ) const
+{
+    const osgGeo::TilingInfo& ti = *_tilingInfo;
+    const int width = lastCol-firstCol;
     const int udfIdx = getDataLayerIndex( _stackUndefLayerId );
-    float udf = 0.0f;
+    const osg::Vec2f step( scale.x(), 0.0f );
 
-    const std::vector<LayerProcess*>& constProcs = _processes;
-    std::vector<LayerProcess*>::const_reverse_iterator it;
+    std::vector<osg::Vec4f> fragColors( width );
+    std::vector<float> udfs( width, 0.0f );
+    std::vector<osg::Vec4f> udfVecs( udfIdx>=0 ? width : 0 );
 
-    for ( int s=0; s<width; s++ )
+    std::vector<LayerProcess*>::const_iterator it;
+
+    for ( int t=firstRow; t<lastRow; t++ )
     {
-	for ( int t=0; t<height; t++ )
+	osg::Vec2f start( (firstCol+0.5)*scale.x(), (t+0.5)*scale.y() );
+	start += ti._envelopeOrigin;
+
+	if ( udfIdx>=0 )
 	{
-	    osg::Vec2f globalCoord( (s+0.5)*scale.x(), (t+0.5)*scale.y() );
-	    globalCoord += ti._envelopeOrigin;
+	    _dataLayers[udfIdx]->getTextureVecSpan( start, step, width,
+						    &udfVecs[0] );
+	    for ( int s=0; s<width; s++ )
+		udfs[s] = udfVecs[s][_stackUndefChannel];
+	}
+
+	for ( int s=0; s<width; s++ )
+	    fragColors[s] = osg::Vec4f( -1.0f, -1.0f, -1.0f, -1.0f );
 
-	    osg::Vec4f fragColor( -1.0f, -1.0f, -1.0f, -1.0f );
+	for ( it=activeProcs.begin(); it!=activeProcs.end(); it++ )
+	{
+	    (*it)->doProcessSpan( &fragColors[0], &udfs[0], start, step, width );
 
-	    if ( udfIdx>=0 )
-		udf = _dataLayers[udfIdx]->getTextureVec(globalCoord)[_stackUndefChannel];
+	    int s = 0;
+	    while ( s<width &&
+		    LayerProcess::isSpanFragmentDone(fragColors[s],udfs[s]) )
+		s++;
 
-	    if ( udf<1.0 )
-	    {
-		for ( it=constProcs.rbegin(); it!=constProcs.rend(); it++ )
-		{
-		    if ( (*it)->getTransparencyType() == FullyTransparent )
-			continue;
+	    if ( s==width )
+		break;
+	}
 
-		    (*it)->doProcess( fragColor, udf, globalCoord );
+	unsigned char* ptr = image.data( firstCol, t );
 
-		    if ( fragColor[3]>=1.0f )
-			break;
-		}
+	for ( int s=0; s<width; s++, ptr+=4 )
+	{
+	    osg::Vec4f& fragColor = fragColors[s];
+	    // Overflow layers leave the stack undef to the final pass
+	    const float udf = applyStackUndef ? udfs[s] : 0.0f;
 
-		if ( fragColor[0]==-1.0f )
-		    fragColor = osg::Vec4f( 1.0f, 1.0f, 1.0f, 1.0f );
-	    }
+	    if ( !applyStackUndef && fragColor[0]==-1.0f )
+		fragColor = osg::Vec4f( 0.0f, 0.0f, 0.0f, 0.0f );
+	    else if ( udf<1.0f && fragColor[0]==-1.0f )
+		fragColor = osg::Vec4f( 1.0f, 1.0f, 1.0f, 1.0f );
 
 	    if ( udf>=1.0f )
 		fragColor = _stackUndefColor;
@@ -1915,12 +3984,26 @@ void LayeredTexture::createCompositeTexture()
 		int val = (int) floor( fragColor[tc]+0.5 );
 		val = val<=0 ? 0 : (val>=255 ? 255 : val);
 
-		image->data(s,t)[tc] = (unsigned char) val;
+		ptr[tc] = (unsigned char) val;
 	    }
 	}
     }
+}
+
+
+void LayeredTexture::createCompositeTexture()
+{
+    if ( !_compositeLayerUpdate )
+	return;
 
-    setDataLayerImage( _compositeLayerId, image );
+    _compositeLayerUpdate = false;
+
+    // Transparency types are evaluated lazily, so not on the workers
+    const std::vector<LayerProcess*>& activeProcs =
+				updateProcessPlanIfNeeded()._activeProcs;
+
+    compositeLayerImage( _compositeLayerId, activeProcs, _compositeDirtyAll,
+			 _compositeDirtyMin, _compositeDirtyMax, true );
 
     if ( !_useShaders )
     {
@@ -1930,6 +4013,105 @@ void LayeredTexture::createCompositeTexture()
 }
 
 
+void LayeredTexture::compositeLayerImage( int layerId, const std::vector<LayerProcess*>& activeProcs, bool& dirtyAll, osg::Vec2f& dirtyMin, osg::Vec2f& dirtyMax, bool applyStackUndef )
+{
+    if ( _tilingInfo->_needsUpdate || _tilingInfo->_needsRefit )
+	dirtyAll = true;
+
+    updateTilingInfoIfNeeded();
+    const osgGeo::TilingInfo& ti = *_tilingInfo;
+
+    const int width  = (int) ceil( ti._envelopeSize.x()/ti._smallestScale.x() );
+    const int height = (int) ceil( ti._envelopeSize.y()/ti._smallestScale.y() );
+    if ( width<1 || height<1 )
+	return;
+
+    const osg::Vec2f scale( ti._envelopeSize.x()/float(width),
+			    ti._envelopeSize.y()/float(height) );
+
+    const int idx = getDataLayerIndex( layerId );
+    LayeredTextureData& compositeLayer = *_dataLayers[idx];
+    osg::Image* image = const_cast<osg::Image*>( compositeLayer._image.get() );
+
+    if ( !image || width!=image->s() || height!=image->t() )
+    {
+	image = new osg::Image;
+	image->allocateImage( width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE );
+	dirtyAll = true;
+    }
+
+    if ( compositeLayer._origin!=ti._envelopeOrigin ||
+	 compositeLayer._scale!=scale )
+	dirtyAll = true;
+
+    compositeLayer._origin = ti._envelopeOrigin;
+    compositeLayer._scale = scale;
+
+    osgGeo::Vec2i start( 0, 0 );
+    osgGeo::Vec2i stop( width, height );
+    compositeLayer._dirtySize = osgGeo::Vec2i( 0, 0 );
+
+    if ( !dirtyAll )
+    {
+	if ( dirtyMin.x() > dirtyMax.x() )
+	    return;
+
+	for ( int dim=0; dim<2; dim++ )
+	{
+	    const float minPix = (dirtyMin[dim]-ti._envelopeOrigin[dim]) / scale[dim] - 0.5f;
+	    const float maxPix = (dirtyMax[dim]-ti._envelopeOrigin[dim]) / scale[dim] + 0.5f;
+
+	    start[dim] = std::max( 0, (int) floor(minPix) );
+	    stop[dim] = std::min( stop[dim], (int) ceil(maxPix) );
+	}
+
+	compositeLayer._dirtyOrigin = start;
+	compositeLayer._dirtySize = osgGeo::Vec2i( stop.x()-start.x(),
+						   stop.y()-start.y() );
+    }
+
+    dirtyAll = false;
+    dirtyMin = osg::Vec2f( 1.0f, 1.0f );
+    dirtyMax = osg::Vec2f( -1.0f, -1.0f );
+
+    if ( start.x()>=stop.x() || start.y()>=stop.y() )
+	return;
+
+    const int regionHeight = stop.y()-start.y();
+    const int regionSize = (stop.x()-start.x()) * regionHeight;
+    const int nrBlocks = (regionHeight+sCompositeBlockRows-1) / sCompositeBlockRows;
+    int nrThreads = OpenThreads::GetNumberOfProcessors();
+    if ( nrThreads>nrBlocks )
+	nrThreads = nrBlocks;
+
+    if ( nrThreads<=1 || regionSize<sMinParallelCompositeSize )
+    {
+	CompositeTextureBuilder builder( *this, *image, activeProcs, scale,
+					 start, stop, 0, 1, applyStackUndef );
+	builder.run();
+    }
+    else
+    {
+	std::vector<CompositeTextureBuilder*> builders;
+	for ( int tidx=0; tidx<nrThreads; tidx++ )
+	{
+	    builders.push_back( new CompositeTextureBuilder(*this, *image,
+			activeProcs, scale, start, stop, tidx, nrThreads,
+			applyStackUndef) );
+	    builders.back()->startThread();
+	}
+
+	for ( int tidx=0; tidx<nrThreads; tidx++ )
+	{
+	    builders[tidx]->join();
+	    delete builders[tidx];
+	}
+    }
+
+    setDataLayerImage( layerId, image );
+}
+
+
 const osg::Image* LayeredTexture::getCompositeTextureImage()
 {
     createCompositeTexture();
@@ -1937,6 +4119,77 @@ const osg::Image* LayeredTexture::getCompositeTextureImage()
 }
 
 
+void LayeredTexture::updateOverflowLayer()
+{
+    const ProcessPlan& pp = updateProcessPlanIfNeeded();
+    if ( pp._overflowProcs.empty() || getDataLayerIndex(_overflowLayerId)==-1 )
+	return;
+
+    // Only image changes allow updating part of the overflow layer
+    std::string key;
+    getOverflowKey( key );
+    if ( key!=_overflowKey )
+    {
+	_overflowKey = key;
+	_overflowDirtyAll = true;
+    }
+
+    compositeLayerImage( _overflowLayerId, pp._overflowProcs, _overflowDirtyAll,
+			 _overflowDirtyMin, _overflowDirtyMax, false );
+}
+
+
+static void appendToKey( std::string& key, const void* data, int size )
+{
+    key.append( (const char*) data, size );
+}
+
+
+void LayeredTexture::getOverflowKey( std::string& key ) const
+{
+    key.clear();
+    appendToKey( key, &_stackUndefLayerId, sizeof(int) );
+    appendToKey( key, &_stackUndefChannel, sizeof(int) );
+    appendToKey( key, &_invertUndefLayers, sizeof(bool) );
+
+    const std::vector<LayerProcess*>& procs = _processPlan->_overflowProcs;
+    std::vector<LayerProcess*>::const_iterator it = procs.begin();
+    for ( ; it!=procs.end(); it++ )
+    {
+	const LayerProcess* process = *it;
+	appendToKey( key, &process, sizeof(LayerProcess*) );
+
+	// Shader code covers the structural settings of any process
+	process->getShaderCode( key, 0 );
+
+	const float opacity = process->getOpacity();
+	appendToKey( key, &opacity, sizeof(float) );
+	appendToKey( key, &process->getNewUndefColor(), sizeof(osg::Vec4f) );
+
+	if ( process->getColorSequencePtr() )
+	    appendToKey( key, process->getColorSequencePtr(), 1024 );
+
+	std::vector<int> ids;
+	getProcessLayerIDs( *this, *process, ids );
+
+	std::vector<int>::const_iterator iit = ids.begin();
+	for ( ; iit!=ids.end(); iit++ )
+	{
+	    const int idx = getDataLayerIndex( *iit );
+	    if ( idx==-1 )
+		continue;
+
+	    const LayeredTextureData& layer = *_dataLayers[idx];
+	    appendToKey( key, &layer._origin, sizeof(osg::Vec2f) );
+	    appendToKey( key, &layer._scale, sizeof(osg::Vec2f) );
+	    appendToKey( key, &layer._filterType, sizeof(FilterType) );
+	    appendToKey( key, &layer._borderColor, sizeof(osg::Vec4f) );
+	    appendToKey( key, &layer._undefColor, sizeof(osg::Vec4f) );
+	}
+    }
+}
+
+
 //============================================================================
 
 
@@ -1992,14 +4245,11 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
     const int udfId = _layTex.getDataLayerUndefLayerID(id);
 
     char line[100];
+    std::string sample;
 
     char to[5] = ""; 
-    char from[5] = ""; 
     if ( toIdx>=0 )
-    {
 	sprintf( to, "[%d]", toIdx );
-	sprintf( from, "[%d]", fromIdx );
-    }
 
     code += nrUdf ? "    if ( udf < 1.0 )\n"
 		  : "    if ( true )\n";
@@ -2015,8 +4265,8 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 	sprintf( line, "        texcrd = gl_TexCoord[%d].st;\n", udfUnit );
 	code += line;
 	const int udfChannel = _layTex.getDataLayerUndefChannel(id);
-	sprintf( line, "        udf = texture2D( texture%d, texcrd )[%d];\n", udfUnit, udfChannel );
-	code += line;
+	_layTex.getDataLayerSampleCode( sample, udfId, udfChannel );
+	code += "        udf = " + sample + ";\n";
 	if ( _layTex.areUndefLayersInverted() )
 	    code += "        udf = 1.0 - udf;\n";
 
@@ -2029,8 +4279,9 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 	    sprintf( line, "            texcrd = gl_TexCoord[%d].st;\n", unit );
 	    code += line;
 	}
-	sprintf( line, "            col%s = texture2D( texture%d, texcrd )%s;\n", to, unit, from );
-	code += line;
+	_layTex.getDataLayerSampleCode( sample, id, toIdx>=0 ? fromIdx : -1 );
+	sprintf( line, "            col%s = ", to );
+	code += line + sample + ";\n";
 
 	const osg::Vec4f& udfColor = _layTex.getDataLayerImageUndefColor(id);
 	if ( toIdx<0 )
@@ -2047,7 +4298,7 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 		if ( ext.size()>4 )
 		    ext.clear();
 
-		sprintf( line, "            udfcol = vec4(%.6f,%.6f,%.6f,%.6f);\n", udfColor[0], udfColor[1], udfColor[2], udfColor[3] );
+		sprintf( line, "            udfcol = udfcolor%d;\n", id );
 		code += line;
 		code += "            if ( udf > 0.0 )\n";
 		sprintf( line, "                col%s = (col%s - udf*udfcol%s) / (1.0-udf);\n", ext.data(), ext.data(), ext.data() );
@@ -2057,7 +4308,7 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
 	else if ( udfColor[fromIdx]>=0.0f )
 	{
 	    code += "            if ( udf > 0.0 )\n";
-	    sprintf( line, "                col%s = (col%s - %.6f*udf) / (1.0-udf);\n", to, to, udfColor[fromIdx] );
+	    sprintf( line, "                col%s = (col%s - udfcolor%d[%d]*udf) / (1.0-udf);\n", to, to, id, fromIdx );
 	    code += line;
 	}
 
@@ -2073,21 +4324,46 @@ void LayerProcess::getHeaderCode( std::string& code, int& nrUdf, int id, int toI
     {
 	sprintf( line, "        texcrd = gl_TexCoord[%d].st;\n", unit );
 	code += line;
-	sprintf( line, "        col%s = texture2D( texture%d, texcrd )%s;\n", to, unit, from );
-	code += line;
+	_layTex.getDataLayerSampleCode( sample, id, toIdx>=0 ? fromIdx : -1 );
+	sprintf( line, "        col%s = ", to );
+	code += line + sample + ";\n";
     }
 
     code += "    }\n";
 }
 
 
+int LayerProcess::getProcessIndex() const
+{
+    for ( int idx=0; idx<_layTex.nrProcesses(); idx++ )
+    {
+	if ( _layTex.getProcess(idx)==this )
+	    return idx;
+    }
+
+    return -1;
+}
+
+
+void LayerProcess::setShaderUniforms( osg::StateSet& stateset ) const
+{
+    const int procIdx = getProcessIndex();
+    char uniformName[40];
+    sprintf( uniformName, "newudfcolor%d", procIdx );
+    stateset.getOrCreateUniform( uniformName, osg::Uniform::FLOAT_VEC4 )->set( _newUndefColor );
+    sprintf( uniformName, "opacity%d", procIdx );
+    stateset.getOrCreateUniform( uniformName, osg::Uniform::FLOAT )->set( _opacity );
+}
+
+
 void LayerProcess::getFooterCode( std::string& code, int& nrUdf, int stage ) const
 {
     char line[100];
+    const int procIdx = getProcessIndex();
 
     if ( nrUdf )
     {
-	sprintf( line, "    udfcol = vec4(%.6f,%.6f,%.6f,%.6f);\n", _newUndefColor[0], _newUndefColor[1], _newUndefColor[2], _newUndefColor[3] );
+	sprintf( line, "    udfcol = newudfcolor%d;\n", procIdx );
 	code += line;
 
 	code += "\n"
@@ -2103,27 +4379,21 @@ void LayerProcess::getFooterCode( std::string& code, int& nrUdf, int stage ) con
 		    "    {\n"
 		    "        udf = (udf-stackudf) / (1.0-stackudf);\n";
 
-	if ( _newUndefColor[3]<=0.0f )
-	    code += "        col.a *= 1.0-udf;\n";
-	else if ( _newUndefColor[3]>=1.0f && getTransparencyType(true)==Opaque )
-	    code += "        col = mix( col, udfcol, udf );\n";
-	else
-	{
-	    if ( !stackUdf )
-		code += "    {\n";
+	// General blend, also covers transparent and opaque udfcol
+	if ( !stackUdf )
+	    code += "    {\n";
 
-	    code += "        if ( col.a > 0.0 )\n"
-		    "        {\n"
-		    "            a = col.a;\n"
-		    "            col.a = mix( a, udfcol.a, udf );\n"
-		    "            col.rgb = mix(a*col.rgb, udfcol.a*udfcol.rgb, udf) / col.a;\n"
-		    "        }\n"
-		    "        else\n"
-		    "            col = vec4( udfcol.rgb, udf*udfcol.a );\n";
+	code += "        if ( col.a > 0.0 )\n"
+		"        {\n"
+		"            a = col.a;\n"
+		"            col.a = mix( a, udfcol.a, udf );\n"
+		"            col.rgb = mix(a*col.rgb, udfcol.a*udfcol.rgb, udf) / col.a;\n"
+		"        }\n"
+		"        else\n"
+		"            col = vec4( udfcol.rgb, udf*udfcol.a );\n";
 
-	    if ( !stackUdf )                                                    
-		code += "    }\n";
-	}
+	if ( !stackUdf )
+	    code += "    }\n";
 
 	if ( stackUdf )
 	    code += "    }\n";
@@ -2132,11 +4402,8 @@ void LayerProcess::getFooterCode( std::string& code, int& nrUdf, int stage ) con
 	nrUdf = 0;
     }
 
-    if ( _opacity<1.0 )
-    {
-	sprintf( line, "    col.a *= %.6f;\n", _opacity );
-	code += line;
-    }
+    sprintf( line, "    col.a *= opacity%d;\n", procIdx );
+    code += line;
 
     if ( stage )
     {
@@ -2157,43 +4424,125 @@ void LayerProcess::processHeader( osg::Vec4f& col, float& udf, const osg::Vec2f&
 	return;
 
     const int udfId = _layTex.getDataLayerUndefLayerID(id);
+    const osg::Vec4f& udfCol = _layTex.getDataLayerImageUndefColor(id);
 
-    if ( _layTex.getDataLayerIndex(udfId)>=0 )
+    if ( _layTex.getDataLayerIndex(udfId)<0 )
     {
-	const float oldUdf = udf;
-	const int udfChannel = _layTex.getDataLayerUndefChannel(id);
-	udf = _layTex.getDataLayerTextureVec(udfId,coord)[udfChannel];
-	if ( _layTex.areUndefLayersInverted() )
-	    udf = 1.0-udf;
+	mergeHeaderSample( col, udf, _layTex.getDataLayerTextureVec(id,coord),
+			   0, udfCol, toIdx, fromIdx );
+	return;
+    }
+
+    const int udfChannel = _layTex.getDataLayerUndefChannel(id);
+    float layerUdf = _layTex.getDataLayerTextureVec(udfId,coord)[udfChannel];
+    if ( _layTex.areUndefLayersInverted() )
+	layerUdf = 1.0-layerUdf;
 
-	if ( udf<1.0f )
+    const osg::Vec4f texVec = layerUdf<1.0f ?
+		_layTex.getDataLayerTextureVec(id,coord) : osg::Vec4f();
+
+    mergeHeaderSample( col, udf, texVec, &layerUdf, udfCol, toIdx, fromIdx );
+}
+
+
+void LayerProcess::processHeaderSpan( osg::Vec4f* cols, float* udfs, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr, int id, int toIdx, int fromIdx ) const
+{
+    std::vector<osg::Vec4f> texVecs( nr );
+    _layTex.getDataLayerTextureVecSpan( id, globalStart, globalStep, nr,
+					&texVecs[0] );
+
+    const int udfId = _layTex.getDataLayerUndefLayerID(id);
+    const osg::Vec4f& udfCol = _layTex.getDataLayerImageUndefColor(id);
+
+    if ( _layTex.getDataLayerIndex(udfId)<0 )
+    {
+	for ( int idx=0; idx<nr; idx++ )
 	{
-	    const osg::Vec4f& udfCol = _layTex.getDataLayerImageUndefColor(id);
+	    if ( udfs[idx]<1.0f )
+		mergeHeaderSample( cols[idx], udfs[idx], texVecs[idx], 0,
+				   udfCol, toIdx, fromIdx );
+	}
 
-	    if ( toIdx<0 )
-	    {
-		col = _layTex.getDataLayerTextureVec( id, coord );
-		for ( int idx=0; idx<4; idx++ )
-		{
-		    if ( udf>0.0f && udfCol[idx]>=0.0f )
-			col[idx] = (col[idx] - udfCol[idx]*udf) / (1.0f-udf);
-		}
-	    }
-	    else
+	return;
+    }
+
+    std::vector<osg::Vec4f> udfVecs( nr );
+    _layTex.getDataLayerTextureVecSpan( udfId, globalStart, globalStep, nr,
+					&udfVecs[0] );
+
+    const int udfChannel = _layTex.getDataLayerUndefChannel(id);
+    const bool inverted = _layTex.areUndefLayersInverted();
+
+    for ( int idx=0; idx<nr; idx++ )
+    {
+	if ( udfs[idx]>=1.0f )
+	    continue;
+
+	float layerUdf = udfVecs[idx][udfChannel];
+	if ( inverted )
+	    layerUdf = 1.0-layerUdf;
+
+	mergeHeaderSample( cols[idx], udfs[idx], texVecs[idx], &layerUdf,
+			   udfCol, toIdx, fromIdx );
+    }
+}
+
+
+void LayerProcess::mergeHeaderSample( osg::Vec4f& col, float& udf, const osg::Vec4f& texVec, const float* layerUdf, const osg::Vec4f& udfCol, int toIdx, int fromIdx )
+{
+    if ( !layerUdf )
+    {
+	if ( toIdx<0 )
+	    col = texVec;
+	else
+	    col[toIdx] = texVec[fromIdx];
+
+	return;
+    }
+
+    const float lu = *layerUdf;
+
+    if ( lu<1.0f )
+    {
+	if ( toIdx<0 )
+	{
+	    col = texVec;
+	    for ( int idx=0; idx<4; idx++ )
 	    {
-		col[toIdx] = _layTex.getDataLayerTextureVec(id,coord)[fromIdx];
-		if ( udf>0.0f && udfCol[fromIdx]>=0.0f )
-		    col[toIdx] = (col[toIdx]-udfCol[fromIdx]*udf) / (1.0f-udf);
+		if ( lu>0.0f && udfCol[idx]>=0.0f )
+		    col[idx] = (col[idx] - udfCol[idx]*lu) / (1.0f-lu);
 	    }
 	}
+	else
+	{
+	    col[toIdx] = texVec[fromIdx];
+	    if ( lu>0.0f && udfCol[fromIdx]>=0.0f )
+		col[toIdx] = (col[toIdx]-udfCol[fromIdx]*lu) / (1.0f-lu);
+	}
+    }
+
+    if ( lu>udf )
+	udf = lu;
+}
+
 
-	if ( udf<oldUdf )
-	    udf = oldUdf;
+void LayerProcess::initSpanUndefs( float* udfs, const osg::Vec4f* fragColors, const float* stackUdfs, int nr )
+{
+    // Fully undefined fragments are skipped by processHeader(Span)
+    for ( int idx=0; idx<nr; idx++ )
+	udfs[idx] = isSpanFragmentDone(fragColors[idx],stackUdfs[idx]) ? 1.0f
+								     : 0.0f;
+}
+
+
+void LayerProcess::doProcessSpan( osg::Vec4f* fragColors, const float* stackUdfs, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr )
+{
+    for ( int idx=0; idx<nr; idx++ )
+    {
+	if ( !isSpanFragmentDone(fragColors[idx],stackUdfs[idx]) )
+	    doProcess( fragColors[idx], stackUdfs[idx],
+		       globalStart + globalStep*float(idx) );
     }
-    else if ( toIdx<0 )
-	col = _layTex.getDataLayerTextureVec( id, coord );
-    else
-	col[toIdx] = _layTex.getDataLayerTextureVec(id,coord)[fromIdx];
 }
 
 
@@ -2322,7 +4671,7 @@ void ColTabLayerProcess::getShaderCode( std::string& code, int stage ) const
 }
 
 
-TransparencyType ColTabLayerProcess::getTransparencyType( bool imageOnly ) const
+TransparencyType ColTabLayerProcess::getTransparencyType( bool imageOnly, const osg::Vec2f* globalOrigin, const osg::Vec2f* globalOpposite ) const
 {
     if ( !_colorSequence || !_layTex.getDataLayerImage(_id) )
 	return FullyTransparent;
@@ -2361,6 +4710,38 @@ void ColTabLayerProcess::doProcess( osg::Vec4f& fragColor, float stackUdf, const
 }
 
 
+void ColTabLayerProcess::doProcessSpan( osg::Vec4f* fragColors, const float* stackUdfs, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr )
+{
+    if ( !_colorSequence || _layTex.getDataLayerIndex(_id)<0 || nr<1 )
+	return;
+
+    std::vector<osg::Vec4f> cols( nr );
+    std::vector<float> udfs( nr );
+    initSpanUndefs( &udfs[0], fragColors, stackUdfs, nr );
+
+    processHeaderSpan( &cols[0], &udfs[0], globalStart, globalStep, nr, _id,
+		       0, _textureChannel );
+
+    const unsigned char* rgba = _colorSequence->getRGBAValues();
+
+    for ( int idx=0; idx<nr; idx++ )
+    {
+	if ( isSpanFragmentDone(fragColors[idx],stackUdfs[idx]) )
+	    continue;
+
+	osg::Vec4f& col = cols[idx];
+	const int val = (int) floor( 255.0f*col[0] + 0.5 );
+	const int offset = val<=0 ? 0 : (val>=255 ? 1020 : 4*val);
+	const unsigned char* ptr = rgba+offset;
+	for ( int tc=0; tc<4; tc++ )
+	    col[tc] = float(*ptr++) / 255.0f;
+
+	processFooter( fragColors[idx], stackUdfs[idx],
+		       globalStart+globalStep*float(idx), col, udfs[idx] );
+    }
+}
+
+
 //============================================================================
 
 
@@ -2426,12 +4807,13 @@ void RGBALayerProcess::getShaderCode( std::string& code, int stage ) const
 }
 
 
-TransparencyType RGBALayerProcess::getTransparencyType( bool imageOnly ) const
+TransparencyType RGBALayerProcess::getTransparencyType( bool imageOnly, const osg::Vec2f* globalOrigin, const osg::Vec2f* globalOpposite ) const
 {
     if ( !_isOn[3] || _layTex.getDataLayerIndex(_id[3])<0 )
 	return imageOnly ? Opaque : multiplyOpacity( Opaque, _opacity );
 
-    TransparencyType tt = _layTex.getDataLayerTransparencyType( _id[3], _textureChannel[3] );
+    TransparencyType tt = _layTex.getDataLayerTransparencyType( _id[3],
+		_textureChannel[3], globalOrigin, globalOpposite );
 
     if ( imageOnly )
 	return tt;
@@ -2465,6 +4847,34 @@ void RGBALayerProcess::doProcess( osg::Vec4f& fragColor, float stackUdf, const o
     }
 
     processFooter( fragColor, stackUdf, globalCoord, col, udf );
+}
+
+
+void RGBALayerProcess::doProcessSpan( osg::Vec4f* fragColors, const float* stackUdfs, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr )
+{
+    if ( nr<1 )
+	return;
+
+    std::vector<osg::Vec4f> cols( nr, osg::Vec4f(0.0f,0.0f,0.0f,1.0f) );
+    std::vector<float> udfs( nr );
+    initSpanUndefs( &udfs[0], fragColors, stackUdfs, nr );
+
+    for ( int idx=0; idx<4; idx++ )
+    {
+	if ( _isOn[idx] && _layTex.getDataLayerIndex(_id[idx])>=0 )
+	{
+	    processHeaderSpan( &cols[0], &udfs[0], globalStart, globalStep, nr,
+			       _id[idx], idx, _textureChannel[idx] );
+	}
+    }
+
+    for ( int idx=0; idx<nr; idx++ )
+    {
+	if ( !isSpanFragmentDone(fragColors[idx],stackUdfs[idx]) )
+	    processFooter( fragColors[idx], stackUdfs[idx],
+			   globalStart+globalStep*float(idx),
+			   cols[idx], udfs[idx] );
+    }
 }	
 
 
@@ -2494,9 +4904,10 @@ void IdentityLayerProcess::getShaderCode( std::string& code, int stage ) const
 }
 
 
-TransparencyType IdentityLayerProcess::getTransparencyType( bool imageOnly ) const
+TransparencyType IdentityLayerProcess::getTransparencyType( bool imageOnly, const osg::Vec2f* globalOrigin, const osg::Vec2f* globalOpposite ) const
 {
-    TransparencyType tt = _layTex.getDataLayerTransparencyType(_id);
+    TransparencyType tt = _layTex.getDataLayerTransparencyType( _id, 3,
+					globalOrigin, globalOpposite );
 
     if ( imageOnly )
 	return tt;
@@ -2523,4 +4934,25 @@ void IdentityLayerProcess::doProcess( osg::Vec4f& fragColor, float stackUdf, con
 }
 
 
+void IdentityLayerProcess::doProcessSpan( osg::Vec4f* fragColors, const float* stackUdfs, const osg::Vec2f& globalStart, const osg::Vec2f& globalStep, int nr )
+{
+    if ( _layTex.getDataLayerIndex(_id)<0 || nr<1 )
+	return;
+
+    std::vector<osg::Vec4f> cols( nr );
+    std::vector<float> udfs( nr );
+    initSpanUndefs( &udfs[0], fragColors, stackUdfs, nr );
+
+    processHeaderSpan( &cols[0], &udfs[0], globalStart, globalStep, nr, _id );
+
+    for ( int idx=0; idx<nr; idx++ )
+    {
+	if ( !isSpanFragmentDone(fragColors[idx],stackUdfs[idx]) )
+	    processFooter( fragColors[idx], stackUdfs[idx],
+			   globalStart+globalStep*float(idx),
+			   cols[idx], udfs[idx] );
+    }
+}
+
+
 } //namespace
@@ -17,6 +17,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>
 
 #include "Palette"
 
+#include <osg/StateSet>
+#include <osg/Uniform>
+
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OSGGEO_PALETTE_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace osgGeo
 {
@@ -99,4 +108,190 @@ void Palette::setColorPoints(const ColorPointList &cps)
     _colorPoints = cps;
 }
 
+void Palette::bakeTable(ColorTable &table, int size) const
+{
+    if(size < 2)
+        size = 2;
+
+    table.resize(size);
+    for(int i = 0; i < size; ++i)
+    {
+        const osg::Vec3 c = get(float(i), 0.0f, float(size - 1));
+        table[i] = osg::Vec4ub(GLubyte(c.x() * 255.0f + 0.5f),
+                               GLubyte(c.y() * 255.0f + 0.5f),
+                               GLubyte(c.z() * 255.0f + 0.5f),
+                               255);
+    }
+}
+
+void Palette::getRGBAValues(unsigned char *arr) const
+{
+    ColorTable table;
+    bakeTable(table, 256);
+    memcpy(arr, &table[0], 256 * 4);
+}
+
+osg::Uniform *Palette::createTableUniform(const char *name, int size) const
+{
+    ColorTable table;
+    bakeTable(table, size);
+
+    std::string arrayName(name);
+    arrayName += "[0]";
+    osg::Uniform *uniform = new osg::Uniform(osg::Uniform::FLOAT_VEC4, arrayName, table.size());
+    for(unsigned int i = 0; i < table.size(); ++i)
+    {
+        const osg::Vec4ub &c = table[i];
+        uniform->setElement(i, osg::Vec4(c.r() / 255.0f, c.g() / 255.0f,
+                                         c.b() / 255.0f, c.a() / 255.0f));
+    }
+    return uniform;
+}
+
+void Palette::addColorPointUniforms(osg::StateSet &stateSet) const
+{
+    // the horizon shaders declare arrays of this size
+    const int maxSize = 20;
+    const int sz = std::min(int(_colorPoints.size()), maxSize);
+
+    osg::Uniform *colourPoints = new osg::Uniform(osg::Uniform::FLOAT_VEC4, "colourPoints[0]", maxSize);
+    osg::Uniform *colourPositions = new osg::Uniform(osg::Uniform::FLOAT, "colourPositions[0]", maxSize);
+    for(int i = 0; i < sz; ++i)
+    {
+        colourPoints->setElement(i, osg::Vec4(_colorPoints[i].color, 1.0));
+        colourPositions->setElement(i, _colorPoints[i].pos);
+    }
+
+    stateSet.addUniform(colourPoints);
+    stateSet.addUniform(colourPositions);
+    stateSet.addUniform(new osg::Uniform("paletteSize", sz));
+}
+
+namespace
+{
+
+// Scale that maps [min, max] to table indices. A degenerate range behaves
+// like Palette::get: everything above min gets the last colour.
+inline float tableScale(int tableSize, float min, float max)
+{
+    if(fuzzyCompare(max, min) || max < min)
+        return 1e30f;
+
+    return float(tableSize - 1) / (max - min);
+}
+
+inline void storeColor(unsigned char *dst, const osg::Vec4ub &c)
+{
+    memcpy(dst, c.ptr(), 4);
+}
+
+template<typename T>
+void applyTableScalar(const ColorTable &table, const T *values,
+                      unsigned int nr, float min, float scale,
+                      float undefValue, const osg::Vec4ub &undefColor,
+                      unsigned char *rgba)
+{
+    const float last = float(table.size() - 1);
+    for(unsigned int i = 0; i < nr; ++i, rgba += 4)
+    {
+        const float val = float(values[i]);
+
+        // written such that NaNs end up as undefined
+        if(!(val < undefValue))
+        {
+            storeColor(rgba, undefColor);
+            continue;
+        }
+
+        float idx = (val - min) * scale + 0.5f;
+        idx = idx > 0.0f ? (idx < last ? idx : last) : 0.0f;
+        storeColor(rgba, table[int(idx)]);
+    }
+}
+
+#ifdef OSGGEO_PALETTE_SSE2
+
+inline __m128 load4(const float *ptr)
+{
+    return _mm_loadu_ps(ptr);
+}
+
+inline __m128 load4(const double *ptr)
+{
+    const __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(ptr));
+    const __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(ptr + 2));
+    return _mm_movelh_ps(lo, hi);
+}
+
+template<typename T>
+void applyTableSSE2(const ColorTable &table, const T *values,
+                    unsigned int nr, float min, float scale,
+                    float undefValue, const osg::Vec4ub &undefColor,
+                    unsigned char *rgba)
+{
+    const __m128 vMin = _mm_set1_ps(min);
+    const __m128 vScale = _mm_set1_ps(scale);
+    const __m128 vHalf = _mm_set1_ps(0.5f);
+    const __m128 vZero = _mm_setzero_ps();
+    const __m128 vLast = _mm_set1_ps(float(table.size() - 1));
+    const __m128 vUndef = _mm_set1_ps(undefValue);
+
+    const unsigned int nrBlocks = nr / 4;
+    int idx[4];
+    for(unsigned int b = 0; b < nrBlocks; ++b, values += 4, rgba += 16)
+    {
+        const __m128 val = load4(values);
+        // not-less-than is also true for NaNs
+        const int undefMask = _mm_movemask_ps(_mm_cmpnlt_ps(val, vUndef));
+
+        __m128 f = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(val, vMin), vScale), vHalf);
+        f = _mm_min_ps(_mm_max_ps(f, vZero), vLast);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(idx), _mm_cvttps_epi32(f));
+
+        for(int l = 0; l < 4; ++l)
+            storeColor(rgba + 4 * l, (undefMask & (1 << l)) ? undefColor : table[idx[l]]);
+    }
+
+    applyTableScalar(table, values, nr % 4, min, scale, undefValue, undefColor, rgba);
+}
+
+#endif
+
+template<typename T>
+void applyTableImpl(const ColorTable &table, const T *values,
+                    unsigned int nr, float min, float max,
+                    float undefValue, const osg::Vec4ub &undefColor,
+                    unsigned char *rgba)
+{
+    if(table.empty())
+        return;
+
+    const float scale = tableScale(table.size(), min, max);
+#ifdef OSGGEO_PALETTE_SSE2
+    applyTableSSE2(table, values, nr, min, scale, undefValue, undefColor, rgba);
+#else
+    applyTableScalar(table, values, nr, min, scale, undefValue, undefColor, rgba);
+#endif
+}
+
+}
+
+void Palette::applyTable(const ColorTable &table,
+                         const float *values, unsigned int nr,
+                         float min, float max,
+                         float undefValue, const osg::Vec4ub &undefColor,
+                         unsigned char *rgba)
+{
+    applyTableImpl(table, values, nr, min, max, undefValue, undefColor, rgba);
+}
+
+void Palette::applyTable(const ColorTable &table,
+                         const double *values, unsigned int nr,
+                         float min, float max,
+                         float undefValue, const osg::Vec4ub &undefColor,
+                         unsigned char *rgba)
+{
+    applyTableImpl(table, values, nr, min, max, undefValue, undefColor, rgba);
+}
+
 }
@@ -15,12 +15,22 @@
 //
 
 #include "ShaderUtility.h"
+#include "EmbeddedShaders.h"
 
 #include <osg/Program>
 
 #include <osgDB/FileUtils>
 #include <osgDB/fstream>
 
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include <sys/stat.h>
+
+#include <map>
+#include <vector>
+#include <iostream>
+
 
 namespace osgGeo
 {
@@ -32,14 +42,107 @@ void ShaderUtility::setRootPath(const char *rootPath)
     _root = rootPath;
 }
 
-osg::Program *ShaderUtility::createProgram(std::string vs, std::string fs, std::string gs)
+osg::ref_ptr<osg::Program> ShaderUtility::createProgram(std::string vs, std::string fs, std::string gs)
+{
+    std::string definitions;
+    for(std::set<std::string>::const_iterator it = _definition.begin(); it != _definition.end(); ++it)
+        definitions += *it + ";";
+
+    return getOrCreateProgram(readFile(vs), readFile(fs),
+                              gs.empty() ? std::string() : readFile(gs), definitions);
+}
+
+namespace
+{
+
+struct CachedProgram
+{
+    std::string vsSource, fsSource, gsSource, definitions;
+    osg::ref_ptr<osg::Program> program;
+};
+
+typedef std::multimap<unsigned int, CachedProgram> ProgramCache;
+
+// programs by hash of their sources, shared by the whole process
+OpenThreads::Mutex programCacheMutex;
+ProgramCache programCache;
+
+// unused programs are only dropped when the cache grows beyond this,
+// so toggling layers does not recompile
+const unsigned int maxUnusedPrograms = 64;
+
+// FNV-1a
+unsigned int hashString(const std::string &str, unsigned int hash)
+{
+    for(std::string::const_iterator it = str.begin(); it != str.end(); ++it)
+    {
+        hash ^= (unsigned char) *it;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void pruneProgramCache()
+{
+    if(programCache.size() <= maxUnusedPrograms)
+        return;
+
+    ProgramCache::iterator it = programCache.begin();
+    while(it != programCache.end())
+    {
+        // only referenced by the cache
+        if(it->second.program->referenceCount() == 1)
+            programCache.erase(it++);
+        else
+            ++it;
+    }
+}
+
+}
+
+osg::ref_ptr<osg::Program> ShaderUtility::getOrCreateProgram(const std::string &vsSource,
+                                                const std::string &fsSource,
+                                                const std::string &gsSource,
+                                                const std::string &definitions)
 {
-    osg::Program* program = new osg::Program;
+    // separators keep ("ab","c") and ("a","bc") apart
+    unsigned int hash = 2166136261u;
+    hash = hashString(vsSource, hash);
+    hash = hashString("\1", hash);
+    hash = hashString(fsSource, hash);
+    hash = hashString("\1", hash);
+    hash = hashString(gsSource, hash);
+    hash = hashString("\1", hash);
+    hash = hashString(definitions, hash);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(programCacheMutex);
+
+    std::pair<ProgramCache::iterator, ProgramCache::iterator> range =
+            programCache.equal_range(hash);
+    for(ProgramCache::iterator it = range.first; it != range.second; ++it)
+    {
+        const CachedProgram &cached = it->second;
+        if(cached.vsSource == vsSource && cached.fsSource == fsSource &&
+           cached.gsSource == gsSource && cached.definitions == definitions)
+            return cached.program;
+    }
+
+    pruneProgramCache();
 
-    program->addShader( new osg::Shader( osg::Shader::VERTEX, readFile(vs) ) );
-    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, readFile(fs) ) );
-    if(!gs.empty())
-        program->addShader( new osg::Shader( osg::Shader::GEOMETRY, readFile(gs) ) );
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+
+    program->addShader( new osg::Shader( osg::Shader::VERTEX, vsSource ) );
+    program->addShader( new osg::Shader( osg::Shader::FRAGMENT, fsSource ) );
+    if(!gsSource.empty())
+        program->addShader( new osg::Shader( osg::Shader::GEOMETRY, gsSource ) );
+
+    CachedProgram entry;
+    entry.vsSource = vsSource;
+    entry.fsSource = fsSource;
+    entry.gsSource = gsSource;
+    entry.definitions = definitions;
+    entry.program = program;
+    programCache.insert(std::make_pair(hash, entry));
 
     return program;
 }
@@ -47,152 +150,215 @@ osg::Program *ShaderUtility::createProgram(std::string vs, std::string fs, std::
 namespace
 {
 
+struct CachedFile
+{
+    CachedFile() : mTime(0) {}
+
+    time_t mTime;
+    std::string contents;
+};
+
+// file contents by path, shared by all ShaderUtility instances
+OpenThreads::Mutex fileCacheMutex;
+std::map<std::string, CachedFile> fileCache;
+
 bool readRawFile(const char* fName, std::string& s)
 {
     std::string foundFile = osgDB::findDataFile(fName);
     if (foundFile.empty()) return false;
 
+    struct stat st;
+    const bool hasStat = !stat(foundFile.c_str(), &st);
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(fileCacheMutex);
+
+    std::map<std::string, CachedFile>::const_iterator it = fileCache.find(foundFile);
+    if(hasStat && it != fileCache.end() && it->second.mTime == st.st_mtime)
+    {
+        s = it->second.contents;
+        return true;
+    }
+
     osgDB::ifstream is;//(fName);
-    is.open(foundFile.c_str());
+    is.open(foundFile.c_str(), std::ios::in | std::ios::binary);
     if (is.fail())
     {
         std::cerr << "Could not open " << fName << " for reading.\n";
         return false;
     }
-    char ch = is.get();
-    while (!is.eof())
-    {
-        s += ch;
-        ch = is.get();
-    }
-    is.close();
-    return true;
-}
 
-struct Lexer
-{
-    Lexer() : pos(0) {}
+    is.seekg(0, std::ios::end);
+    const std::streamoff size = is.tellg();
+    is.seekg(0, std::ios::beg);
 
-    size_t findNext(const std::string &needle)
-    {
-        size_t res = src.find(needle, pos);
-        pos = res + 1;
-        return res;
-    }
+    s.resize(size > 0 ? size_t(size) : 0);
+    if(!s.empty())
+        is.read(&s[0], s.size());
+    s.resize(size_t(is.gcount()));
+    is.close();
 
-    void reset()
+    if(hasStat)
     {
-        pos = 0;
+        CachedFile &entry = fileCache[foundFile];
+        entry.mTime = st.st_mtime;
+        entry.contents = s;
     }
 
-    std::string src;
-    size_t pos;
-};
+    return true;
+}
 
-const char *tok_lParen = "(";
-const char *tok_rParen = ")";
-const char *tok_quote = "\"";
-const char *tok_at = "@";
-const char *tok_include = "@include";
+const std::string tok_include = "@include";
 const std::string tok_if = "@if";
 const std::string tok_else = "@else";
 const std::string tok_endIf = "@endif";
-const char *tok_semicolon = ";";
+
+// protects against files including each other
+const int maxIncludeDepth = 32;
+
+bool startsWith(const std::string &src, size_t pos, const std::string &tok)
+{
+    return !src.compare(pos, tok.size(), tok);
 }
 
-std::string ShaderUtility::readFile(std::string fileName)
+/**
+  * Reads the quoted argument of a directive like @if("name"), pos
+  * points behind the directive and is moved behind the closing paren.
+  */
+bool readArgument(const std::string &src, size_t &pos, std::string &arg)
 {
-    Lexer lx;
-    bool res = readRawFile(getFullPath(fileName).c_str(), lx.src);
-    if(!res)
-        return std::string();
+    const size_t posStart = src.find('"', pos);
+    if(posStart == std::string::npos)
+        return false;
 
-    // look for include directives
+    const size_t posEnd = src.find('"', posStart + 1);
+    if(posEnd == std::string::npos)
+        return false;
 
-    while(true)
-    {
-        bool foundAnything = false;
+    const size_t rParen = src.find(')', posEnd + 1);
+    if(rParen == std::string::npos)
+        return false;
 
-        // @include statement
-        lx.reset();
-        while(true)
-        {
-            const size_t tokStart = lx.findNext(tok_include);
-            if(tokStart == std::string::npos)
-                break;
+    arg = src.substr(posStart + 1, posEnd - posStart - 1);
+    pos = rParen + 1;
+    return true;
+}
 
-            foundAnything = true;
-            lx.findNext(tok_lParen);
+}
 
-            size_t posStart = lx.findNext(tok_quote) + 1;
-            size_t posEnd = lx.findNext(tok_quote);
+/**
+  * Expands @include and @if/@else/@endif directives of src into out in
+  * a single pass. Conditional blocks may be nested.
+  */
+void ShaderUtility::preprocess(const std::string &src, std::string &out, int depth) const
+{
+    // one entry per open @if, true if its current branch is emitted
+    std::vector<bool> active;
+    bool emitting = true;
 
-            std::string newFileName = lx.src.substr(posStart, posEnd - posStart);
-            lx.findNext(tok_rParen);
+    size_t pos = 0;
+    while(pos < src.size())
+    {
+        const size_t at = src.find('@', pos);
+        const size_t chunkEnd = at == std::string::npos ? src.size() : at;
+        if(emitting)
+            out.append(src, pos, chunkEnd - pos);
 
-            lx.src = lx.src.substr(0, tokStart) +
-                     readFile(newFileName) +
-                     lx.src.substr(lx.pos);
-        }
+        if(at == std::string::npos)
+            break;
+
+        pos = at;
 
-        // @if @else @endif statements
-        while(true)
+        std::string arg;
+        if(startsWith(src, pos, tok_include))
         {
-            const size_t tokStart = lx.findNext(tok_if);
-            if(tokStart == std::string::npos)
+            pos += tok_include.size();
+            if(!readArgument(src, pos, arg))
+            {
+                std::cerr << "Malformed " << tok_include << " in shader source.\n";
                 break;
+            }
 
-            foundAnything = true;
-
-            size_t posStart = lx.findNext(tok_quote) + 1;
-            size_t posEnd = lx.findNext(tok_quote);
-
-            std::string clause = lx.src.substr(posStart, posEnd - posStart);
-            bool isTrue = _definition.count(clause);
-
-            size_t startBlock = lx.findNext(tok_rParen) + 1;
+            if(!emitting)
+                continue;
 
-            std::string ifBlock;
-            std::string elseBlock;
-            bool foundElse = false;
+            if(depth >= maxIncludeDepth)
+            {
+                std::cerr << "Shader includes nested too deep at " << arg << ".\n";
+                continue;
+            }
 
-            while(true)
+            std::string included;
+            if(readSource(arg, included))
+                preprocess(included, out, depth + 1);
+        }
+        else if(startsWith(src, pos, tok_if))
+        {
+            pos += tok_if.size();
+            if(!readArgument(src, pos, arg))
             {
-                if(lx.src[lx.pos] == '@')
-                {
-                    if(!lx.src.compare(lx.pos, tok_else.size(), tok_else))
-                    {
-                        ifBlock = lx.src.substr(startBlock, lx.pos - startBlock);
-                        lx.pos += tok_else.size();
-                        startBlock = lx.pos;
-                        foundElse = true;
-                        continue;
-                    }
-                    else if(!lx.src.compare(lx.pos, tok_endIf.size(), tok_endIf))
-                    {
-                        std::string tmp = lx.src.substr(startBlock, lx.pos - startBlock);
-                        if(foundElse)
-                            elseBlock = tmp;
-                        else
-                            ifBlock = tmp;
-
-                        lx.pos += tok_endIf.size();
-                        break;
-                    }
-                }
-                lx.pos++;
+                std::cerr << "Malformed " << tok_if << " in shader source.\n";
+                break;
             }
 
-            lx.src = lx.src.substr(0, tokStart) +
-                     (isTrue ? ifBlock : elseBlock) +
-                     lx.src.substr(lx.pos);
+            const bool isTrue = _definition.count(arg);
+            active.push_back(emitting && isTrue);
         }
+        else if(startsWith(src, pos, tok_else))
+        {
+            pos += tok_else.size();
+            if(active.empty())
+                continue;
 
-        if(!foundAnything)
-            break;
+            const bool parentEmitting = active.size() < 2 || active[active.size() - 2];
+            active.back() = parentEmitting && !active.back();
+        }
+        else if(startsWith(src, pos, tok_endIf))
+        {
+            pos += tok_endIf.size();
+            if(!active.empty())
+                active.pop_back();
+        }
+        else
+        {
+            if(emitting)
+                out += '@';
+            pos++;
+        }
+
+        emitting = active.empty() || active.back();
     }
+}
+
+bool ShaderUtility::readSource(const std::string &fileName, std::string &src)
+{
+    // an override directory may hold modified shaders
+    if(!_root.empty() && readRawFile(getFullPath(fileName).c_str(), src))
+        return true;
+
+    for(const EmbeddedShader *shader = embeddedShaders; shader->name; ++shader)
+    {
+        if(fileName == shader->name)
+        {
+            src = shader->source;
+            return true;
+        }
+    }
+
+    std::cerr << "Shader " << fileName << " not found.\n";
+    return false;
+}
+
+std::string ShaderUtility::readFile(std::string fileName)
+{
+    std::string src;
+    bool res = readSource(fileName, src);
+    if(!res)
+        return std::string();
 
-    return lx.src;
+    std::string out;
+    out.reserve(src.size());
+    preprocess(src, out, 0);
+    return out;
 }
 
 std::string ShaderUtility::getFullPath(std::string fileName)
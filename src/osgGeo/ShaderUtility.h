@@ -20,6 +20,7 @@
 #include <string>
 #include <set>
 
+#include <osg/ref_ptr>
 #include <osgGeo/Common>
 
 namespace osg { class Program; }
@@ -27,6 +28,10 @@ namespace osg { class Program; }
 namespace osgGeo
 {
 
+/**
+  * Reads and preprocesses the osgGeo shaders. Shaders are compiled into
+  * the library; if a root path is set, files found there take precedence.
+  */
 class OSGGEO_EXPORT ShaderUtility
 {
 public:
@@ -35,10 +40,29 @@ public:
 
     void addDefinition(std::string def);
 
-    osg::Program *createProgram(std::string vs, std::string fs, std::string gs = "");
+    /**
+      * Returns the program for the given shader files, with the added
+      * definitions. The program is shared through the cache of
+      * getOrCreateProgram(), so callers must not modify it.
+      */
+    osg::ref_ptr<osg::Program> createProgram(std::string vs, std::string fs, std::string gs = "");
     std::string readFile(std::string fileName);
 
+    /**
+      * Returns a program built from the given shader sources. Programs
+      * are shared process-wide, an identical program created before is
+      * returned instead of compiling a new one. Shared programs must not
+      * be modified by the caller.
+      */
+    static osg::ref_ptr<osg::Program> getOrCreateProgram(const std::string &vsSource,
+                                            const std::string &fsSource,
+                                            const std::string &gsSource = "",
+                                            const std::string &definitions = "");
+
 private:
+    static bool readSource(const std::string &fileName, std::string &src);
+    void preprocess(const std::string &src, std::string &out, int depth) const;
+
     static std::string _root;
     std::set<std::string> _definition;
 };
@@ -96,6 +96,12 @@ void TexturePlaneNode::traverse( osg::NodeVisitor& nv )
     {
 	if ( needsUpdate() )
 	    updateGeometry();
+
+	if ( _texture )
+	{
+	    const osg::FrameStamp* fs = nv.getFrameStamp();
+	    _texture->frameUpdate( fs ? (int) fs->getFrameNumber() : -1 );
+	}
     }
     else if ( nv.getVisitorType()==osg::NodeVisitor::CULL_VISITOR )
     {
@@ -1,7 +1,6 @@
 #version 130
 
-uniform sampler2D heightMap;
-in vec2 texCoordOut;
+in float heightValueOut;
 
 in float diffuseValue;
 
@@ -11,8 +10,7 @@ uniform int paletteSize;
 
 void main(void)
 {
-  vec4 pix = texture2D(heightMap, texCoordOut);
-  float value = pix.g;
+  float value = heightValueOut;
   int sz = paletteSize;
   vec4 col;
 
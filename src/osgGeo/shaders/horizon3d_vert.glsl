@@ -1,28 +1,31 @@
 #version 130
 
 uniform sampler2D heightMap;
-uniform sampler2D normals;
 uniform float depthMin;
 uniform float depthDiff;
 
 out float depthOut;
-out int undef;
-
-@if("hasGeomShader")
-out vec2 texCoordPass;
-out float diffuseValuePass;
-@else
-out vec2 texCoordOut;
+out float heightValueOut;
 out float diffuseValue;
-@endif
+
+// decodes octahedral encoded normal from [0..1]^2
+vec3 decodeNormal(vec2 enc)
+{
+    vec2 e = enc * 2.0 - 1.0;
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if(n.z < 0.0)
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return normalize(n);
+}
 
 void main(void)
 {
     // Extract texture coordinate
     vec2 texCoord = gl_MultiTexCoord0.st;
 
-    // fetch value from the height map. Luminance component
-    // contains elevation value, alpha contains undefined flag
+    // fetch value from the height map. Red component contains
+    // elevation value, green and blue the normal. Undefined
+    // positions are not referenced by the index buffer.
     vec4 depthMask = texture2D(heightMap, texCoord);
     float depthComp = depthMask.r;
 
@@ -31,13 +34,9 @@ void main(void)
     vec4 pos = vec4(gl_Vertex.xy, depthOut, 1.0);
     gl_Position = gl_ModelViewProjectionMatrix * pos;
 
-    // pass undefined value to geometry shader
-    undef = (depthMask.a > 0.1) ? 1 : 0;
-
     // Normals and lighting
 
-    //read normal from texture and denormalize it
-    vec3 normal = texture2D(normals, texCoord).xyz * 2.0 - 1.0;
+    vec3 normal = decodeNormal(depthMask.gb);
 
     // Transforming The Normal To ModelView-Space
     vec3 vertex_normal = normalize(gl_NormalMatrix * (-normal));
@@ -48,12 +47,6 @@ void main(void)
     if(diffuse_value < 0)
       diffuse_value *= -1;
 
-    // trickery to pass values to either geometry or fragment shader.
-    @if("hasGeomShader")
-        texCoordPass = texCoord;
-        diffuseValuePass = diffuse_value;
-    @else
-        texCoordOut = texCoord;
-        diffuseValue = diffuse_value;
-    @endif
+    heightValueOut = depthComp;
+    diffuseValue = diffuse_value;
 }